@@ -0,0 +1,26 @@
+#ifndef MSWEEP_KALLISTO_BATCH_HPP
+#define MSWEEP_KALLISTO_BATCH_HPP
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <cstdint>
+
+#include "sparse_matrix.hpp"
+
+// Equivalence classes of a kallisto batch (matrix.ec) and their
+// counts in each cell (matrix.tsv). The groups hit by each
+// equivalence class are counted once and shared by all cells.
+struct KallistoBatch {
+  // Ids of the equivalence classes in matrix.ec
+  std::vector<uint32_t> ec_ids;
+  // Number of references in each group hit by each equivalence class
+  SparseMatrix<uint16_t> counts;
+
+  std::vector<std::string> cell_names;
+  // (equivalence class, count) pairs of each cell sorted by the
+  // equivalence class
+  std::vector<std::vector<std::pair<uint32_t, uint32_t>>> cell_counts;
+};
+
+#endif
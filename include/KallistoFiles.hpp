@@ -8,6 +8,8 @@
 #include "bxzstr.hpp"
 #include "file.hpp"
 
+#include "parallel_input.hpp"
+
 class KallistoFiles {
  private:
   bool file_exists (const std::string& name) const {
@@ -15,11 +17,11 @@ class KallistoFiles {
     return (!test.stream().fail()); 
   }
 
-  void open_file(const std::string &path, std::unique_ptr<std::istream> &ptr) const {
+  void open_file(const std::string &path, std::unique_ptr<std::istream> &ptr, const unsigned n_threads) const {
     if (!file_exists(path)) {
       throw std::runtime_error("File: " + path + " does not exist.");
     }
-    ptr.reset(new bxz::ifstream(path));
+    ptr = OpenParallelInput(path, n_threads);
     if (!ptr->good()) {
       throw std::runtime_error("Cannot read from file: " + path + ".");
     }
@@ -33,14 +35,16 @@ class KallistoFiles {
   std::unique_ptr<std::istream> run_info;
   bool batch_mode = false;
 
-  KallistoFiles(std::string path, bool batch_mode) : batch_mode(batch_mode) {
+  // The files are decompressed on background threads, BGZF files
+  // with `n_threads` threads each.
+  KallistoFiles(std::string path, bool batch_mode, unsigned n_threads = 1) : batch_mode(batch_mode) {
     std::string alignment_path = path + (batch_mode ? "/matrix" : "/pseudoalignments");
     if (batch_mode) {
-      open_file(path + "/matrix.cells", this->cells);
+      open_file(path + "/matrix.cells", this->cells, n_threads);
     }
-    open_file(alignment_path + ".ec", this->ec);
-    open_file(alignment_path + ".tsv", this->tsv);
-    open_file(path + "/run_info.json", this->run_info);
+    open_file(alignment_path + ".ec", this->ec, n_threads);
+    open_file(alignment_path + ".tsv", this->tsv, n_threads);
+    open_file(path + "/run_info.json", this->run_info, n_threads);
   }
 };
 
@@ -0,0 +1,17 @@
+#ifndef MSWEEP_MANIFEST_HPP
+#define MSWEEP_MANIFEST_HPP
+
+#include <string>
+#include <vector>
+
+// A sample listed in a --manifest file. One sample per line:
+//   <name>\t<themisto strand 1>\t<themisto strand 2>
+//   <name>\t<kallisto output folder or --write-cache file>
+// Empty lines and lines starting with '#' are skipped.
+struct ManifestEntry {
+  // Written to <name>_abundances.txt, or to <-o>/<name>_abundances.txt.
+  std::string name;
+  std::vector<std::string> inputs;
+};
+
+#endif
@@ -3,6 +3,10 @@
 
 #include <vector>
 #include <array>
+#include <string>
+#include <memory>
+
+#include "matrix.hpp"
 
 struct Grouping {
   std::vector<uint32_t> indicators;
@@ -12,12 +16,26 @@ struct Grouping {
 };
 
 class Reference {
+private:
+  // The parameters that grouping.bb_params were calculated with
+  std::array<double, 2> bb_params_from = { { 0.0, 0.0 } };
+  // Log-likelihoods read from a reference index
+  std::shared_ptr<const Matrix<double>> lls;
+
 public:
   Grouping grouping;
   std::vector<std::string> group_names;
   uint32_t n_refs;
   
   void calculate_bb_parameters(double params[2]);
+  // Log-likelihoods for the grouping, shared by all samples.
+  std::shared_ptr<const Matrix<double>> likelihoods() const;
+
+  // Write the grouping and its beta-binomial parameters (and the
+  // log-likelihoods if `write_lls` is true) to a binary index.
+  void write_index(const std::string &path, const bool write_lls) const;
+  // Read a reference index written by write_index.
+  void read_index(const std::string &path);
 };
 
 #endif
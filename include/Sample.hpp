@@ -5,17 +5,28 @@
 #include <vector>
 #include <fstream>
 #include <random>
+#include <memory>
 
 #include "telescope.hpp"
 
 #include "matrix.hpp"
+#include "sparse_matrix.hpp"
+#include "posterior.hpp"
 #include "Reference.hpp"
 #include "parse_arguments.hpp"
 
+class RcgWorkspace;
+struct KallistoBatch;
+struct GroupCountEcs;
+class NumberFormat;
+
 class VSample {
 public:
   virtual void read_themisto(const Mode &mode, const uint32_t n_refs, std::vector<std::istream*> &strands) =0;
   virtual void read_kallisto(const uint32_t n_refs, std::istream &tsv_file, std::istream &ec_file) =0;
+  virtual void read_kallisto_cell(const KallistoBatch &batch, const uint32_t cell) =0;
+  virtual void stream_themisto(const std::string &merge_mode, const Grouping &grouping, std::istream &strand_1, std::istream &strand_2) =0;
+  virtual void read_cache(const Grouping &grouping, const std::string &path) =0;
 };
 
 class Sample : public VSample{
@@ -24,8 +35,8 @@ private:
   uint32_t m_num_ecs;
   std::string cell_id;
 
-  // Count the number of pseudoalignments in groups defined by the given indicators.
-  std::vector<uint16_t> group_counts(const std::vector<uint32_t> indicators, const uint32_t ec_id, const uint32_t n_groups) const;
+  // Write the probabilities as ec_id,group,probability rows
+  void write_sparse_probabilities(const std::vector<std::string> &cluster_indicators_to_string, const unsigned top_k, const double min_prob, const NumberFormat &format, std::ostream &of) const;
 
   // Free the memory taken by ec_configs
   void clear_configs() { pseudos.ec_configs.clear(); }
@@ -33,22 +44,34 @@ private:
 protected:
   // Calculate log_ec_counts and counts_total.
   void process_aln();
+  // Take the counts of one cell from a kallisto batch and share its
+  // other tables.
+  void process_cell(const KallistoBatch &batch, const uint32_t cell);
+  // Take the equivalence classes read from a Themisto stream.
+  void process_group_ecs(GroupCountEcs &ecs);
+  // Load the state written by write_cache.
+  void process_cache(const Grouping &grouping, const std::string &path);
+  // Relative abundances from the probabilities `probs` for the given
+  // equivalence class counts.
+  static std::vector<double> group_abundances(const Posterior &probs, const std::vector<double> &log_counts, const uint32_t total);
 
   KallistoAlignment pseudos;
   uint32_t counts_total;
 
 public:
-  Matrix<double> ec_probs;
-  Matrix<double> ll_mat;
-  std::vector<std::vector<uint16_t>> counts;
+  std::unique_ptr<Posterior> ec_probs;
+  std::shared_ptr<const Matrix<double>> ll_mat;
+  // Number of references in each group hit by each equivalence class
+  SparseMatrix<uint16_t> counts;
   std::vector<double> log_ec_counts;
 
   // Retrieve relative abundances from the ec_probs matrix.
   std::vector<double> group_abundances() const;
   // Write estimated relative abundances
-  void write_abundances(const std::vector<std::string> &cluster_indicators_to_string, std::string outfile) const;
-  // Write estimated read-reference posterior probabilities (gamma_Z)
-  void write_probabilities(const std::vector<std::string> &cluster_indicators_to_string, const bool gzip_probs, std::ostream &outfile) const;
+  void write_abundances(const std::vector<std::string> &cluster_indicators_to_string, const OptimizerArgs &args, std::string outfile) const;
+  // Write estimated read-reference posterior probabilities (gamma_Z),
+  // as a sparse table if args.probs_top_k or args.probs_min are set.
+  void write_probabilities(const std::vector<std::string> &cluster_indicators_to_string, const OptimizerArgs &args, std::ostream &outfile) const;
   // Getters
   std::string cell_name() const { return cell_id; };
   uint32_t num_ecs() const { return m_num_ecs; };
@@ -57,29 +80,43 @@ public:
   // Read Themisto or kallisto pseudoalignments
   void read_themisto(const Mode &mode, const uint32_t n_refs, std::vector<std::istream*> &strands) override;
   void read_kallisto(const uint32_t n_refs, std::istream &tsv_file, std::istream &ec_file) override;
-  // Fill the likelihood matrix
-  void CalcLikelihood(const Grouping &grouping);
+  void read_kallisto_cell(const KallistoBatch &batch, const uint32_t cell) override;
+  // Read Themisto pseudoalignments one read at a time, grouping the
+  // reads by the number of references hit in each group
+  void stream_themisto(const std::string &merge_mode, const Grouping &grouping, std::istream &strand_1, std::istream &strand_2) override;
+  // Read pseudoalignments from a cache written by write_cache
+  void read_cache(const Grouping &grouping, const std::string &path) override;
+  // Write the counted pseudoalignments to a binary cache
+  void write_cache(const Grouping &grouping, const std::string &path) const;
+  // Count the groups hit by each equivalence class unless already counted
+  void count_groups(const Grouping &grouping);
+  // Use the log-likelihoods of the grouping, shared with other samples
+  void CalcLikelihood(const Grouping &grouping, const std::shared_ptr<const Matrix<double>> &lls);
 };
 
 class BootstrapSample : public Sample {
 private:
-  std::discrete_distribution<uint32_t> ec_distribution;
-  std::vector<std::vector<double>> relative_abundances;
+  // Number of reads in each block of equivalence classes resampled
+  // from the same random number stream
+  std::vector<uint64_t> block_counts;
 
-  // Run estimation and add results to relative_abundances
-  void BootstrapIter(const std::vector<double> &alpha0, const double tolerance, const uint16_t max_iters);
-  // Initialize ec_distributino and ll_mat for bootstrapping
-  void InitBootstrap(const Grouping &grouping);
-  // Resample the equivalence class counts
-  void ResampleCounts(const uint32_t how_many, std::mt19937_64 &rng);
+  // Draw `how_many` reads from the equivalence classes in proportion to
+  // their counts and store the log of the resampled counts.
+  void ResampleCounts(const uint32_t how_many, const uint32_t seed, const uint32_t replicate, std::vector<uint32_t> &block_draws, std::vector<double> &resampled_log_counts) const;
+  std::vector<std::vector<double>> relative_abundances;
 
 public:
-  void WriteBootstrap(const std::vector<std::string> &cluster_indicators_to_string, std::string &outfile, const unsigned iters, const bool batch_mode) const;
-  void BootstrapAbundances(const Reference &reference, const Arguments &args);
+  // Initialize block_counts for bootstrapping
+  void InitBootstrap();
+  void WriteBootstrap(const std::vector<std::string> &cluster_indicators_to_string, std::string &outfile, const unsigned iters, const bool batch_mode, const unsigned precision) const;
+  void BootstrapAbundances(const Reference &reference, const Arguments &args, RcgWorkspace &workspace);
 
   // Read in pseudoalignments but do not free the memory used by storing the equivalence class counts.
   void read_themisto(const Mode &mode, const uint32_t n_refs, std::vector<std::istream*> &strands) override;
   void read_kallisto(const uint32_t n_refs, std::istream &tsv_file, std::istream &ec_file) override;
+  void read_kallisto_cell(const KallistoBatch &batch, const uint32_t cell) override;
+  void stream_themisto(const std::string &merge_mode, const Grouping &grouping, std::istream &strand_1, std::istream &strand_2) override;
+  void read_cache(const Grouping &grouping, const std::string &path) override;
 };
 
 #endif
@@ -0,0 +1,19 @@
+#ifndef MSWEEP_THEMISTO_STREAM_HPP
+#define MSWEEP_THEMISTO_STREAM_HPP
+
+#include <vector>
+#include <cstdint>
+
+#include "sparse_matrix.hpp"
+
+// Equivalence classes of Themisto pseudoalignments read one read at a
+// time. Reads that hit the same number of references in each group
+// have the same likelihood and share an equivalence class.
+struct GroupCountEcs {
+  // Number of references in each group hit by each equivalence class
+  SparseMatrix<uint16_t> counts;
+  // Number of reads in each equivalence class
+  std::vector<uint32_t> ec_counts;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef MSWEEP_BLOCK_QUEUE_HPP
+#define MSWEEP_BLOCK_QUEUE_HPP
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+#include <utility>
+
+// Bounded queue of blocks or samples passed between a producer thread
+// and a consumer thread.
+template <typename T> class BoundedQueue {
+private:
+  const size_t capacity;
+  std::deque<T> blocks;
+  std::mutex mtx;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  bool finished = false;
+  bool cancelled = false;
+
+public:
+  BoundedQueue(const size_t capacity) : capacity(capacity) {}
+
+  // Returns false if the consumer has gone away.
+  bool push(T &&block) {
+    std::unique_lock<std::mutex> lock(mtx);
+    not_full.wait(lock, [this]{ return blocks.size() < capacity || cancelled; });
+    if (cancelled) {
+      return false;
+    }
+    blocks.emplace_back(std::move(block));
+    not_empty.notify_one();
+    return true;
+  }
+  // Returns false when all blocks have been consumed.
+  bool pop(T &block) {
+    std::unique_lock<std::mutex> lock(mtx);
+    not_empty.wait(lock, [this]{ return !blocks.empty() || finished; });
+    if (blocks.empty()) {
+      return false;
+    }
+    std::swap(block, blocks.front());
+    blocks.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+  void finish() {
+    std::lock_guard<std::mutex> lock(mtx);
+    finished = true;
+    not_empty.notify_all();
+  }
+  void cancel() {
+    std::lock_guard<std::mutex> lock(mtx);
+    cancelled = true;
+    not_full.notify_all();
+  }
+};
+
+typedef BoundedQueue<std::string> BlockQueue;
+
+#endif
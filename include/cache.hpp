@@ -0,0 +1,53 @@
+#ifndef MSWEEP_CACHE_HPP
+#define MSWEEP_CACHE_HPP
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#include "Reference.hpp"
+
+// Binary cache of a sample's pseudoalignments after the groups hit by
+// each equivalence class have been counted. The header is followed by
+// the arrays
+//   ec_ids[n_ecs] (uint32), ec_counts[n_ecs] (uint32),
+//   n_hits[n_ecs] (uint32), row_ids[n_hits_total] (uint32),
+//   values[n_hits_total] (uint16)
+// each starting at a multiple of 8 bytes.
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_groups;
+  uint64_t n_refs;
+  uint64_t fingerprint;
+  uint64_t n_ecs;
+  uint64_t n_hits_total;
+  uint64_t counts_total;
+};
+
+static const char CACHE_MAGIC[8] = { 'm', 'S', 'W', 'E', 'E', 'P', 'c', '\0' };
+static const uint32_t CACHE_VERSION = 1;
+
+// Identifies the grouping a cache was written with.
+uint64_t GroupingFingerprint(const Grouping &grouping);
+
+// Size of an array of `n` elements of `size` bytes padded to 8 bytes.
+inline size_t CachePadded(const size_t n, const size_t size) { return (n*size + 7)/8*8; }
+
+// Read-only memory map of a whole file.
+class MappedFile {
+private:
+  const char* m_data = nullptr;
+  size_t m_size = 0;
+
+public:
+  MappedFile(const std::string &path);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return m_data; }
+  size_t size() const { return m_size; }
+};
+
+#endif
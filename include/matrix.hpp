@@ -2,6 +2,11 @@
 #define MSWEEP_MATRIX_HPP
 
 #include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
 
 // Basic matrix structure and operations
 // Implementation was done following the instructions at
@@ -9,38 +14,99 @@
 //
 // **None of the operations validate the matrix sizes**
 
-template <typename T> class Matrix {
+// Storage order of the matrix elements. The estimation code stores
+// reference groups on the rows and equivalence classes on the
+// columns, so ColMajor is the EC-major layout where the values of all
+// groups for one equivalence class are adjacent in memory and
+// RowMajor is the group-major layout.
+enum MatrixLayout { RowMajor, ColMajor };
+
+// The layout is chosen at compile time. EC-major is the default since
+// the optimizer works on one equivalence class at a time; configure
+// with -DCMAKE_MATRIX_ROW_MAJOR=1 to store the matrices group-major.
+#if defined(MSWEEP_ROW_MAJOR_MATRIX)
+#define MSWEEP_MATRIX_LAYOUT RowMajor
+#else
+#define MSWEEP_MATRIX_LAYOUT ColMajor
+#endif
+
+// Allocator returning memory aligned to `Alignment` bytes. Elements
+// constructed without arguments are default-initialized (left as is
+// for arithmetic types) so that the caller can fill the buffer in
+// parallel.
+template <typename T, std::size_t Alignment = 64> struct AlignedAllocator {
+  typedef T value_type;
+  template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+  AlignedAllocator() = default;
+  template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+  T* allocate(std::size_t n) {
+    void* ptr = nullptr;
+    if (n > 0 && posix_memalign(&ptr, Alignment, n*sizeof(T)) != 0) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(ptr);
+  }
+  void deallocate(T* ptr, std::size_t) { std::free(ptr); }
+
+  template <typename U> void construct(U* ptr) { ::new(static_cast<void*>(ptr)) U; }
+  template <typename U, typename... Args> void construct(U* ptr, Args&&... args) {
+    ::new(static_cast<void*>(ptr)) U(std::forward<Args>(args)...);
+  }
+};
+template <typename T, typename U, std::size_t A>
+bool operator==(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return true; }
+template <typename T, typename U, std::size_t A>
+bool operator!=(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return false; }
+
+template <typename T, MatrixLayout Layout = MSWEEP_MATRIX_LAYOUT> class Matrix {
  private:
-  std::vector<std::vector<T> > mat;
-  unsigned rows;
-  unsigned cols;
+  // All elements are stored in a single contiguous 64-byte aligned buffer.
+  std::vector<T, AlignedAllocator<T>> mat;
+  unsigned rows = 0;
+  unsigned cols = 0;
+
+  size_t index(unsigned row, unsigned col) const {
+    return (Layout == RowMajor ? (size_t)row*cols + col : (size_t)col*rows + row);
+  }
 
  public:
   Matrix() = default;
   Matrix(unsigned _rows, unsigned _cols, const T& _initial);
-  Matrix(const Matrix<T>& rhs);
+  Matrix(const Matrix<T, Layout>& rhs);
+  Matrix(Matrix<T, Layout>&& rhs) = default;
   virtual ~Matrix();
 
   // Resize a matrix
   void resize(const uint32_t new_rows, const uint32_t new_cols, const T initial);
+  // Set the dimensions and fill with `initial`. Reuses the buffer
+  // without reallocating if it is large enough.
+  void assign(const uint32_t new_rows, const uint32_t new_cols, const T initial);
+  // Number of elements that fit in the buffer without reallocating
+  size_t capacity() const { return this->mat.capacity(); }
 
   // Operator overloading
-  Matrix<T>& operator=(const Matrix<T>& rhs);
+  Matrix<T, Layout>& operator=(const Matrix<T, Layout>& rhs);
+  Matrix<T, Layout>& operator=(Matrix<T, Layout>&& rhs) = default;
+
+  // Exchange the contents of two matrices without copying
+  void swap(Matrix<T, Layout>& rhs);
 
   // Mathematical operators
   // Matrix-matrix
-  Matrix<T> operator+(const Matrix<T>& rhs) const;
-  Matrix<T>& operator+=(const Matrix<T>& rhs);
-  Matrix<T> operator-(const Matrix<T>& rhs) const;
-  Matrix<T>& operator-=(const Matrix<T>& rhs);
-  Matrix<T> operator*(const Matrix<T>& rhs) const;
-  Matrix<T>& operator*=(const Matrix<T>& rhs);
+  Matrix<T, Layout> operator+(const Matrix<T, Layout>& rhs) const;
+  Matrix<T, Layout>& operator+=(const Matrix<T, Layout>& rhs);
+  Matrix<T, Layout> operator-(const Matrix<T, Layout>& rhs) const;
+  Matrix<T, Layout>& operator-=(const Matrix<T, Layout>& rhs);
+  Matrix<T, Layout> operator*(const Matrix<T, Layout>& rhs) const;
+  Matrix<T, Layout>& operator*=(const Matrix<T, Layout>& rhs);
 
   // Matrix-scalar, only in-place
-  Matrix<T>& operator+=(const T& rhs);
-  Matrix<T>& operator-=(const T& rhs);
-  Matrix<T>& operator*=(const T& rhs);
-  Matrix<T>& operator/=(const T& rhs);
+  Matrix<T, Layout>& operator+=(const T& rhs);
+  Matrix<T, Layout>& operator-=(const T& rhs);
+  Matrix<T, Layout>& operator*=(const T& rhs);
+  Matrix<T, Layout>& operator/=(const T& rhs);
 
   // Matrix-vector
   std::vector<T> operator*(const std::vector<T>& rhs) const;
@@ -51,21 +117,26 @@ template <typename T> class Matrix {
   void exp_right_multiply(const std::vector<T>& rhs, std::vector<T>& result) const;
 
   // Access elements
-  T& operator()(unsigned row, unsigned col);
-  const T& operator()(unsigned row, unsigned col) const;
+  T& operator()(unsigned row, unsigned col) { return this->mat[index(row, col)]; }
+  const T& operator()(unsigned row, unsigned col) const { return this->mat[index(row, col)]; }
 
-  // Access rows and columns
-  const std::vector<T>& get_row(unsigned row_id) const;
-  const std::vector<T>& get_col(unsigned col_id) const;
+  // Raw access to the underlying buffer. Element (row, col) is at
+  // data()[row*row_stride() + col*col_stride()].
+  T* data() { return this->mat.data(); }
+  const T* data() const { return this->mat.data(); }
+  size_t row_stride() const { return (Layout == RowMajor ? this->cols : 1); }
+  size_t col_stride() const { return (Layout == RowMajor ? 1 : this->rows); }
 
   // LogSumExp a Matrix column
   T log_sum_exp_col(unsigned col_id) const;
+  // Exponentiate a Matrix column into `result` (size get_rows())
+  void exp_col(unsigned col_id, T* result) const;
 
   // Fill a matrix with the sum of two matrices
-  void sum_fill(const Matrix<T>& rhs1, const Matrix<T>& rhs2);
+  void sum_fill(const Matrix<T, Layout>& rhs1, const Matrix<T, Layout>& rhs2);
 
   // Transpose
-  Matrix<T> transpose() const;
+  Matrix<T, Layout> transpose() const;
 
   // Get number of rows or columns
   unsigned get_rows() const;
@@ -0,0 +1,34 @@
+#ifndef MSWEEP_OUTPUT_FORMAT_HPP
+#define MSWEEP_OUTPUT_FORMAT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+
+// Appends numbers to a string buffer without going through the
+// locale-aware std::ostream formatting.
+class NumberFormat {
+private:
+  // Significant digits, 0 = the fewest that read back as the same double.
+  unsigned precision;
+
+public:
+  explicit NumberFormat(const unsigned precision = 6) : precision(precision) {}
+
+  void append(const double x, std::string *buf) const;
+  void append(const uint64_t x, std::string *buf) const;
+  void append(const uint32_t x, std::string *buf) const { append((uint64_t)x, buf); }
+};
+
+// Write `n_rows` rows to `out` in order. `format_rows(first, last, buf)`
+// appends rows [first, last) to `buf`; blocks of `rows_per_block` rows
+// are formatted on all threads at once and written as they finish.
+void WriteRows(const size_t n_rows, const size_t rows_per_block, const std::function<void(const size_t, const size_t, std::string*)> &format_rows, std::ostream &out);
+
+// Rows per block so that a block of rows of about `row_bytes` bytes
+// stays around a megabyte.
+size_t RowsPerBlock(const size_t row_bytes);
+
+#endif
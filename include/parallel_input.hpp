@@ -0,0 +1,14 @@
+#ifndef MSWEEP_PARALLEL_INPUT_HPP
+#define MSWEEP_PARALLEL_INPUT_HPP
+
+#include <istream>
+#include <memory>
+#include <string>
+
+// Open `path` for reading with the decompression running ahead of the
+// reader on a background thread. BGZF files (bgzip, samtools) are
+// inflated one batch of blocks at a time on `n_threads` threads; other
+// inputs are decompressed by bxzstr. "-" reads stdin.
+std::unique_ptr<std::istream> OpenParallelInput(const std::string &path, const unsigned n_threads);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef MSWEEP_PARALLEL_OUTPUT_HPP
+#define MSWEEP_PARALLEL_OUTPUT_HPP
+
+#include <ostream>
+#include <memory>
+#include <string>
+
+// Open `path` for writing gzip-compressed output. The output is cut
+// into BGZF blocks that a background thread compresses on `n_threads`
+// threads while the caller keeps writing. The result is a valid
+// multi-member gzip file that gzip, zcat and bgzip can all read.
+std::unique_ptr<std::ostream> OpenParallelGzipOutput(const std::string &path, const unsigned n_threads);
+
+// Wait until everything written to `of` has reached `path`, and throw
+// if any of it failed. Streams from OpenParallelGzipOutput are closed.
+void CloseOutput(std::ostream &of, const std::string &path);
+
+#endif
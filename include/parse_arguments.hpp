@@ -9,11 +9,29 @@
 struct OptimizerArgs {
   uint16_t max_iters = 5000;
   double tolerance = 1e-06;
+  // "rcg" (conjugate gradient), "squarem" (accelerated fixed point) or
+  // "low-memory" (squarem without storing the posterior)
+  std::string method = "rcg";
+  // Stop when the change in the bound ("bound"), the natural gradient
+  // norm ("gradient", rcg only) or the largest change in a relative
+  // abundance ("abundances") is below the tolerance.
+  std::string convergence = "bound";
+  // Optimize only the groups with at least this many expected reads
+  // after a burn-in (0 = all groups).
+  double active_set = 0.0;
 
   std::vector<double> alphas;
   bool write_probs;
   bool gzip_probs;
   bool print_probs;
+  // Write only the probabilities of the top k groups of each
+  // equivalence class and/or those at least probs_min (0 = all).
+  unsigned probs_top_k = 0;
+  double probs_min = 0.0;
+  // Significant digits in the written probabilities and abundances,
+  // 0 = as many as needed to read back the exact value.
+  unsigned precision = 6;
+  bool single_precision = false;
   unsigned nr_threads = 1;
 };
 
@@ -28,6 +46,11 @@ struct Arguments {
   std::string tinfile1;
   std::string tinfile2;
   std::string themisto_index_path;
+  std::string cache_infile;
+  std::string cache_outfile;
+  std::string reference_index;
+  // Samples to estimate one after another (--manifest)
+  std::string manifest_file;
   std::vector<std::string> kallisto_files;
 
   std::string fasta_file;
@@ -38,6 +61,10 @@ struct Arguments {
   bool bootstrap_mode = false;
   bool compressed_input = false;
   bool themisto_mode = false;
+  bool themisto_stream = false;
+  // Write a reference index (`mSWEEP index`) instead of estimating
+  bool index_mode = false;
+  bool index_lls = false;
 
   std::string themisto_merge_mode = "union";
 
@@ -52,5 +79,6 @@ struct Arguments {
 
 void ParseArguments(int argc, char *argv[], Arguments &args);
 void PrintHelpMessage();
+void PrintIndexHelpMessage();
 
 #endif
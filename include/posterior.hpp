@@ -0,0 +1,159 @@
+#ifndef MSWEEP_POSTERIOR_HPP
+#define MSWEEP_POSTERIOR_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "matrix.hpp"
+#include "sparse_matrix.hpp"
+
+// A sum over the groups that an equivalence class misses is computed
+// directly instead of as a difference if the hits take more than this
+// fraction of the total.
+static const double MISSED_SUM_TOL = 1.0/1048576.0;
+
+template <unsigned N>
+void missed_sums(const SparseMatrix<uint16_t> &counts, const unsigned col, const double* group_vals, const double* totals, double* sums) {
+  // Sums of the N interleaved per-group values in `group_vals` over
+  // the groups that equivalence class `col` misses. The first value
+  // must be positive; if the hits take almost all of its total the
+  // sums are taken over the missed groups directly.
+  size_t hits_start = counts.col_start(col);
+  size_t hits_end = counts.col_end(col);
+  for (unsigned n = 0; n < N; ++n) {
+    sums[n] = totals[n];
+  }
+  for (size_t k = hits_start; k < hits_end; ++k) {
+    for (unsigned n = 0; n < N; ++n) {
+      sums[n] -= group_vals[(size_t)counts.row_id(k)*N + n];
+    }
+  }
+  if (sums[0] < totals[0]*MISSED_SUM_TOL) {
+    std::fill(sums, sums + N, 0.0);
+    size_t k = hits_start;
+    for (unsigned i = 0; i < counts.get_rows(); ++i) {
+      if (k < hits_end && counts.row_id(k) == i) {
+	++k;
+      } else {
+	for (unsigned n = 0; n < N; ++n) {
+	  sums[n] += group_vals[(size_t)i*N + n];
+	}
+      }
+    }
+  }
+}
+
+// Partial sums over chunks of equivalence classes for
+// Posterior::exp_right_multiply. Kept between the calls so that the
+// buffers are allocated only once.
+struct PosteriorSums {
+  std::vector<double> hit_sums;
+  std::vector<double> hit_missed;
+  std::vector<double> missed;
+  std::vector<double> norms;
+  // One column of n_rows + 1 values for each thread
+  std::vector<double> thread_cols;
+
+  // Zero the sums for `n_chunks` chunks of `n_rows` groups.
+  void prepare(const unsigned n_chunks, const unsigned n_rows);
+  // Scratch column of the calling thread
+  double* thread_col(const unsigned n_rows);
+  // Memory taken by the buffers
+  size_t size_in_bytes() const;
+};
+
+// Log read-reference posterior probabilities (gamma_Z) for groups x
+// equivalence classes.
+class Posterior {
+public:
+  virtual ~Posterior() {}
+
+  // Log-probability of group `row` for equivalence class `col`
+  virtual double operator()(const unsigned row, const unsigned col) const =0;
+  // Fill `result` with the log-probabilities of all groups for `col`
+  virtual void fill_col(const unsigned col, double *result) const =0;
+
+  // log-space Matrix-vector right multiplication, store result in arg
+  virtual void exp_right_multiply(const std::vector<double> &rhs, std::vector<double> &result, PosteriorSums &sums) const =0;
+  void exp_right_multiply(const std::vector<double> &rhs, std::vector<double> &result) const {
+    PosteriorSums sums;
+    this->exp_right_multiply(rhs, result, sums);
+  }
+
+  // Get number of rows or columns
+  virtual unsigned get_rows() const =0;
+  virtual unsigned get_cols() const =0;
+};
+
+// The groups that an equivalence class doesn't hit share the
+// zero-count likelihood, so their values are stored as the sum of a
+// per-group and a per-equivalence class term:
+//   gamma_Z(i, j) = hits(i, j) if equivalence class j hits group i,
+//                   group_term[i] + ec_term[j] otherwise.
+// The values of the hits are stored as T (float or double) in the
+// order of the nonzero elements of the counts, which are not copied
+// and must outlive the posterior.
+template <typename T> class SparsePosterior : public Posterior {
+private:
+  const SparseMatrix<uint16_t>* counts = nullptr;
+
+public:
+  std::vector<T> hits;
+  std::vector<double> group_term;
+  std::vector<double> ec_term;
+
+  // Use the nonzero structure of `counts` and set all elements to
+  // `initial`. Reuses the existing buffers if they are large enough.
+  void assign(const SparseMatrix<uint16_t> &counts, const double initial);
+
+  double operator()(const unsigned row, const unsigned col) const override;
+  void fill_col(const unsigned col, double *result) const override;
+  using Posterior::exp_right_multiply;
+  void exp_right_multiply(const std::vector<double> &rhs, std::vector<double> &result, PosteriorSums &sums) const override;
+
+  unsigned get_rows() const override { return this->counts->get_rows(); }
+  unsigned get_cols() const override { return this->counts->get_cols(); }
+};
+
+// Posterior of the plain variational update, computed when it is read
+// instead of stored:
+//   gamma_Z(i, j) = logl(i, counts(i, j)) + digamma_N_k[i] - m[j],
+// where m[j] normalizes column j. Only O(n_groups) values are kept;
+// the likelihoods and the counts must outlive the posterior.
+class FixedPointPosterior : public Posterior {
+private:
+  const Matrix<double>* logl = nullptr;
+  const SparseMatrix<uint16_t>* counts = nullptr;
+  // logl(i, 0) + digamma_N_k[i] shifted so that the largest is 0, its
+  // exponent, and the sum of the exponents.
+  std::vector<double> group_term;
+  std::vector<double> group_weight;
+  double shift = 0.0;
+  double weight_total = 0.0;
+
+  // Writes the shifted log-probabilities of the hits in column `col`
+  // before normalizing to `hits_col` and returns the shifted m[col].
+  double col_terms(const unsigned col, double *hits_col) const;
+
+public:
+  std::vector<double> digamma_N_k;
+
+  // Compute the posterior from `logl` and `counts` with the expected
+  // log-abundances `digamma_N_k`.
+  void assign(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &digamma_N_k);
+  // Sets result[i] = sum_j exp(gamma_Z(i, j) + rhs[j]) and returns
+  // sum_j exp(rhs[j])*m[j].
+  double expected_counts(const std::vector<double> &rhs, std::vector<double> &result, PosteriorSums &sums) const;
+
+  double operator()(const unsigned row, const unsigned col) const override;
+  void fill_col(const unsigned col, double *result) const override;
+  using Posterior::exp_right_multiply;
+  void exp_right_multiply(const std::vector<double> &rhs, std::vector<double> &result, PosteriorSums &sums) const override { this->expected_counts(rhs, result, sums); }
+
+  unsigned get_rows() const override { return this->counts->get_rows(); }
+  unsigned get_cols() const override { return this->counts->get_cols(); }
+};
+
+#endif
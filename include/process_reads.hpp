@@ -3,13 +3,20 @@
 
 #include <string>
 #include <memory>
+#include <ostream>
 
 #include "parse_arguments.hpp"
 #include "Reference.hpp"
 #include "Sample.hpp"
+#include "rcg.hpp"
+#include "Manifest.hpp"
 
 void ProcessReads(const Reference &reference, std::string outfile, Sample &sample, OptimizerArgs args);
+void ProcessReads(const Reference &reference, std::string outfile, Sample &sample, OptimizerArgs args, RcgWorkspace &workspace, std::ostream &log);
 void ProcessBatch(const Reference &reference, Arguments &args, std::vector<std::unique_ptr<Sample>> &bitfields);
+// Estimate the samples in the manifest one after another, reading and
+// writing the neighbouring samples at the same time.
+void ProcessManifest(const Reference &reference, const Arguments &args, const std::vector<ManifestEntry> &manifest);
 void ProcessBootstrap(Reference &reference, Arguments &args, std::vector<std::unique_ptr<Sample>> &bitfields);
 
 #endif
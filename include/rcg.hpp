@@ -2,10 +2,94 @@
 #define MSWEEP_RCG_HPP
 
 #include <vector>
+#include <memory>
+#include <ostream>
+#include <cstddef>
 
 #include "matrix.hpp"
-#include "Sample.hpp"
+#include "sparse_matrix.hpp"
+#include "posterior.hpp"
+#include "parse_arguments.hpp"
 
-Matrix<double> rcg_optl_mat(const Matrix<double> &logl, const Sample &sample, const std::vector<double> &alpha0, const double &tol, uint16_t maxiters);
+// Step of the optimizer in the same form as SparsePosterior. The hits
+// follow the nonzero structure of the sample's counts.
+template <typename T> struct RcgStep {
+  std::vector<T> hits;
+  std::vector<double> group_term;
+  std::vector<double> ec_term;
+};
+
+// The current and the previous step.
+template <typename T> struct RcgSteps {
+  RcgStep<T> step;
+  RcgStep<T> oldstep;
+};
+
+// Buffers used by rcg_optl_mat. A workspace sized for the largest
+// sample can be reused for any number of estimations without
+// allocating more memory.
+class RcgWorkspace {
+private:
+  unsigned n_threads = 0;
+
+public:
+  // Steps for the double and the single precision estimation; only
+  // the one in use is allocated and neither with "low-memory".
+  RcgSteps<double> steps;
+  RcgSteps<float> steps_sp;
+  std::vector<double> oldm;
+  std::vector<double> N_k;
+  // N_k before the last update
+  std::vector<double> old_N_k;
+  std::vector<double> digamma_N_k;
+  // N_0, N_1 and N_2 of the SQUAREM iteration
+  std::vector<double> squarem_N_k;
+  // Per-group values summed over the groups an equivalence class misses
+  std::vector<double> group_vals;
+  // Partial sums for each slab of equivalence classes
+  std::vector<double> slab_N_k;
+  std::vector<double> slab_missed;
+  std::vector<double> slab_missed_total;
+  std::vector<double> slab_norms;
+  std::vector<double> slab_bounds;
+  // Three columns of scratch space for each thread
+  std::vector<double> thread_cols;
+  // Sums for the expected counts under a posterior
+  PosteriorSums posterior_sums;
+
+  RcgWorkspace() = default;
+  RcgWorkspace(const uint16_t n_groups, const uint32_t n_ecs, const size_t n_hits, const OptimizerArgs &args);
+
+  // Set the dimensions for a sample with n_groups x n_ecs and n_hits
+  // nonzero counts, growing the buffers that `args.method` uses if
+  // needed.
+  void prepare(const uint16_t n_groups, const uint32_t n_ecs, const size_t n_hits, const OptimizerArgs &args);
+  // Steps for hits stored as T
+  template <typename T> RcgSteps<T>& get_steps();
+  // Scratch columns of the calling thread
+  double* thread_col(const unsigned n_groups, const unsigned which);
+
+  // Memory taken by the buffers
+  size_t size_in_bytes() const;
+};
+
+// Number of estimations to run at a time when `n_tasks` of them can
+// run concurrently. The threads that are left over are split evenly
+// between them and their number is stored in `n_inner`.
+unsigned concurrent_estimations(const unsigned n_tasks, unsigned &n_inner);
+
+// Estimate the read-reference posterior probabilities into gamma_Z
+// for equivalence classes with the given nonzero structure and
+// observation counts. With `single_precision` the posterior and the
+// steps are stored as floats; all sums are still computed in double
+// precision. The optimizer starts from `initial` if it is not null (it
+// must have the same nonzero structure as `counts`), otherwise from
+// the uniform distribution. The optimizer is chosen by `args.method`;
+// "low-memory" stores a FixedPointPosterior that is computed from the
+// likelihoods and the counts when it is read. With `args.active_set`
+// the groups that get fewer reads are frozen out of the optimization
+// after a burn-in and re-checked when the others have converged.
+// Progress and a convergence report are written to `log`.
+void rcg_optl_mat(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const uint32_t total_counts, const OptimizerArgs &args, const Posterior *initial, RcgWorkspace &workspace, std::unique_ptr<Posterior> &gamma_Z, std::ostream &log);
 
 #endif
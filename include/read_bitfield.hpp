@@ -10,11 +10,22 @@
 #include "Sample.hpp"
 #include "Reference.hpp"
 #include "KallistoFiles.hpp"
+#include "KallistoBatch.hpp"
+#include "ThemistoStream.hpp"
+#include "Manifest.hpp"
 
 void ReadClusterIndicators(std::istream &indicators_file, Reference &reference);
-void MatchClusterIndicators(const char delim, std::istream &groups, std::istream &fasta, Reference &reference);
+void MatchClusterIndicators(const char delim, std::istream &groups, const std::string &fasta_path, Reference &reference);
+void ReadKallistoBatch(const Grouping &grouping, KallistoFiles &kallisto_files, KallistoBatch *batch);
 void ReadBitfield(KallistoFiles &kallisto_files, unsigned n_refs, std::vector<std::unique_ptr<Sample>> &batch, Reference &reference, bool bootstrap_mode);
-void ReadBitfield(const std::string &tinfile1, const std::string &tinfile2, const std::string &themisto_mode, const bool bootstrap_mode, const unsigned n_refs, std::vector<std::unique_ptr<Sample>> &batch);
+void StreamThemisto(const std::string &merge_mode, const Grouping &grouping, std::istream &strand_1, std::istream &strand_2, GroupCountEcs *ecs);
+void StreamBitfield(const std::string &tinfile1, const std::string &tinfile2, const std::string &themisto_mode, const bool bootstrap_mode, const Grouping &grouping, const unsigned n_threads, std::vector<std::unique_ptr<Sample>> &batch);
+void ReadCachedBitfield(const std::string &cache_file, const bool bootstrap_mode, const Grouping &grouping, std::vector<std::unique_ptr<Sample>> &batch);
+void ReadBitfield(const std::string &tinfile1, const std::string &tinfile2, const std::string &themisto_mode, const bool bootstrap_mode, const unsigned n_refs, const unsigned n_threads, std::vector<std::unique_ptr<Sample>> &batch);
+void ReadManifest(std::istream &manifest_file, std::vector<ManifestEntry> *manifest);
+// Read the pseudoalignments of one sample in the manifest, decompressing
+// them with `n_threads` threads.
+void ReadManifestSample(const ManifestEntry &entry, const std::string &themisto_mode, const bool themisto_stream, const Reference &reference, const unsigned n_threads, std::vector<std::unique_ptr<Sample>> &batch);
 void VerifyGrouping(const unsigned n_refs, std::istream &run_info);
 void VerifyThemistoGrouping(const unsigned n_refs, std::istream &themisto_index);
 
@@ -0,0 +1,26 @@
+#ifndef MSWEEP_REFERENCE_INDEX_HPP
+#define MSWEEP_REFERENCE_INDEX_HPP
+
+#include <cstdint>
+
+// Binary reference index written by `mSWEEP index`. The header is
+// followed by the arrays
+//   indicators[n_refs] (uint32), sizes[n_groups] (uint16),
+//   bb_params[n_groups] (2 x double), name_offsets[n_groups + 1] (uint64),
+//   names[names_bytes] (char), lls[n_groups][lls_cols] (double)
+// each starting at a multiple of 8 bytes. The log-likelihoods are
+// left out if lls_cols is 0.
+struct ReferenceIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_groups;
+  uint64_t n_refs;
+  double params[2];
+  uint64_t names_bytes;
+  uint64_t lls_cols;
+};
+
+static const char INDEX_MAGIC[8] = { 'm', 'S', 'W', 'E', 'E', 'P', 'r', '\0' };
+static const uint32_t INDEX_VERSION = 1;
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef MSWEEP_SPARSE_MATRIX_HPP
+#define MSWEEP_SPARSE_MATRIX_HPP
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Groups x equivalence classes matrix that stores only the nonzero
+// elements of each column, ie. the groups that an equivalence class
+// hits. The elements of column j are at positions col_start(j) ...
+// col_end(j) - 1 of the row index and value arrays, sorted by row.
+//
+// **None of the operations validate the matrix sizes**
+template <typename T> class SparseMatrix {
+ private:
+  std::vector<size_t> starts;
+  std::vector<uint32_t> rows_ids;
+  std::vector<T> vals;
+  unsigned rows = 0;
+
+ public:
+  SparseMatrix() = default;
+
+  // Set the dimensions from the number of nonzero elements in each
+  // column. The row indices and values are filled in by the caller.
+  void allocate(const unsigned n_rows, const std::vector<uint32_t> &col_sizes) {
+    this->rows = n_rows;
+    this->starts.resize(col_sizes.size() + 1);
+    this->starts[0] = 0;
+    for (size_t j = 0; j < col_sizes.size(); ++j) {
+      this->starts[j + 1] = this->starts[j] + col_sizes[j];
+    }
+    this->rows_ids.resize(this->starts.back());
+    this->vals.resize(this->starts.back());
+  }
+
+  // Reserve space for n_cols columns with n_nonzero elements in total.
+  void reserve(const unsigned n_cols, const size_t n_nonzero) {
+    this->starts.reserve(n_cols + 1);
+    this->rows_ids.reserve(n_nonzero);
+    this->vals.reserve(n_nonzero);
+  }
+
+  // Access the nonzero elements
+  size_t col_start(const unsigned col) const { return this->starts[col]; }
+  size_t col_end(const unsigned col) const { return this->starts[col + 1]; }
+  uint32_t& row_id(const size_t pos) { return this->rows_ids[pos]; }
+  const uint32_t& row_id(const size_t pos) const { return this->rows_ids[pos]; }
+  T& value(const size_t pos) { return this->vals[pos]; }
+  const T& value(const size_t pos) const { return this->vals[pos]; }
+
+  // Raw access to the underlying arrays
+  const std::vector<size_t>& col_starts() const { return this->starts; }
+  const std::vector<uint32_t>& row_ids() const { return this->rows_ids; }
+  T* data() { return this->vals.data(); }
+  const T* data() const { return this->vals.data(); }
+
+  // Position of element (row, col) or col_end(col) if it is zero
+  size_t find(const unsigned row, const unsigned col) const {
+    for (size_t k = this->starts[col]; k < this->starts[col + 1]; ++k) {
+      if (this->rows_ids[k] == row) {
+	return k;
+      }
+    }
+    return this->starts[col + 1];
+  }
+
+  // Number of nonzero elements that fit in the buffers
+  size_t capacity() const { return this->vals.capacity(); }
+
+  // Get the dimensions
+  unsigned get_rows() const { return this->rows; }
+  unsigned get_cols() const { return (this->starts.empty() ? 0 : this->starts.size() - 1); }
+  size_t nnz() const { return this->vals.size(); }
+};
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef MSWEEP_SPECIAL_FUNCTIONS_HPP
+#define MSWEEP_SPECIAL_FUNCTIONS_HPP
+
+#include <cstdint>
+#include <vector>
+
+// Digamma function for x > 0 by recurrence to x >= 7 and the
+// asymptotic series.
+double digamma(double x);
+
+// log(n!) for n = 0, ..., max_n.
+std::vector<double> log_factorials(const uint16_t max_n);
+
+#endif
@@ -50,13 +50,13 @@ class Args {
  public:
   std::ifstream fasta;
   std::ifstream groups;
+  std::string fasta_file;
   char delim = '\t';
   Args() {}
   void parse_args(int argc, char *argv[]) {
     if (CmdOptionPresent(argv, argv+argc, "--help")) {
       print_help();
     }
-    std::string fasta_file;
     std::string groups_file;
 
     if (CmdOptionPresent(argv, argv+argc, "--fasta")) {
@@ -86,6 +86,11 @@ class Args {
 };
 
 void matchfasta(std::istream &groups, std::istream &fasta, const char delim, std::vector<std::string> *groups_in_fasta);
+// Read the fasta file through a memory map in parallel chunks; the
+// file must be uncompressed (see fasta_is_mappable).
+void matchfasta(std::istream &groups, const std::string &fasta_path, const char delim, std::vector<std::string> *groups_in_fasta);
+// True if fasta_path is an uncompressed regular file.
+bool fasta_is_mappable(const std::string &fasta_path);
 }
 }
 
@@ -0,0 +1,52 @@
+#ifndef MSWEEP_VMATH_HPP
+#define MSWEEP_VMATH_HPP
+
+#include <cstddef>
+
+// Batched exp/log kernels over contiguous arrays.
+//
+// The kernels use AVX-512 or AVX2+FMA instructions when the CPU
+// supports them (selected at run time with GCC on x86-64, otherwise
+// when the compiler targets them eg. with -march=native) and fall
+// back to the system libm.
+//
+// Accuracy of the vectorized kernels compared to glibc's libm,
+// measured over 10^7 uniformly distributed arguments per range:
+//   exp: max. error 1 ulp for x in [-708.39, 709.78]. Results below
+//        the smallest normal double (x < -708.39) are flushed to zero
+//        and x > 709.78 returns inf. NaN returns NaN.
+//   log: max. error 2 ulp for positive normal x, 3 ulp for x in
+//        [0.5, 2]. log(0) and log of subnormals return -inf, negative
+//        x returns NaN.
+//   log_sum_exp: combines the two; the sum is accumulated in the
+//        order of the vector lanes.
+//
+// The kernels are compiled without -ffast-math since the range
+// reduction depends on the order of the floating point operations.
+namespace vmath {
+// y[i] = exp(x[i]) for i < n, x and y may be the same array.
+void exp(const double *x, double *y, const size_t n);
+
+// y[i] += exp(x[i] + c) for i < n.
+void exp_add(const double *x, const double c, double *y, const size_t n);
+
+// y[i] = log(x[i]) for i < n, x and y may be the same array.
+void log(const double *x, double *y, const size_t n);
+
+// log(sum(exp(x[i]))) over i < n, n must be at least 1.
+double log_sum_exp(const double *x, const size_t n);
+
+// Compensated (Neumaier) summation. add() is compiled with the
+// kernels so that the compensation isn't optimized away.
+class CompensatedSum {
+private:
+  double sum = 0.0;
+  double compensation = 0.0;
+
+public:
+  void add(const double x);
+  double value() const { return this->sum + this->compensation; }
+};
+}
+
+#endif
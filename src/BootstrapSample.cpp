@@ -1,79 +1,146 @@
 #include "Sample.hpp"
 
+#include <algorithm>
+#include <sstream>
+
 #include "likelihood.hpp"
 #include "rcg.hpp"
+#include "parallel_output.hpp"
+#include "output_format.hpp"
+#include "read_bitfield.hpp"
+#include "openmp_config.hpp"
 #include "version.h"
 
-#include "bxzstr.hpp"
+// The equivalence classes are resampled in blocks of this size, each
+// from its own random number stream.
+static const uint32_t RESAMPLE_BLOCK_SIZE = 4096;
+
+// Buffers for estimating one bootstrap replicate at a time
+struct BootstrapBuffers {
+  std::vector<uint32_t> block_draws;
+  std::vector<double> log_ec_counts;
+  std::unique_ptr<Posterior> ec_probs;
+  RcgWorkspace workspace;
+};
 
-void BootstrapSample::InitBootstrap(const Grouping &grouping) {
-  ec_distribution = std::discrete_distribution<uint32_t>(pseudos.ec_counts.begin(), pseudos.ec_counts.end());
-  CalcLikelihood(grouping);
+std::mt19937_64 ReplicateGenerator(const uint32_t seed, const uint32_t replicate, const uint32_t stream) {
+  // Independent random number streams for each replicate so that the
+  // results don't depend on the order the replicates are run in.
+  std::seed_seq seq{ seed, replicate, stream };
+  return std::mt19937_64(seq);
 }
 
-void BootstrapSample::ResampleCounts(const uint32_t how_many, std::mt19937_64 &generator) {
-  std::vector<uint32_t> tmp_counts(num_ecs());
-  for (uint32_t i = 0; i < how_many; ++i) {
-    uint32_t ec_id = ec_distribution(generator);
-    tmp_counts[ec_id] += 1;
+uint32_t DrawBinomial(const uint32_t n, const uint64_t weight, const uint64_t total_weight, std::mt19937_64 &generator) {
+  // How many of the n reads left are drawn from a category with
+  // `weight` out of the `total_weight` remaining.
+  if (n == 0 || weight == 0) {
+    return 0;
+  } else if (weight >= total_weight) {
+    return n;
   }
+  std::binomial_distribution<uint32_t> binomial(n, (double)weight/(double)total_weight);
+  return std::min(binomial(generator), n);
+}
+
+void BootstrapSample::ResampleCounts(const uint32_t how_many, const uint32_t seed, const uint32_t replicate, std::vector<uint32_t> &block_draws, std::vector<double> &resampled_log_counts) const {
+  // Multinomial sample by conditional binomial splitting: the reads
+  // are first split between the blocks of equivalence classes, then
+  // between the equivalence classes in each block.
+  const std::vector<uint32_t> &weights = pseudos.ec_counts;
+  uint32_t n_blocks = block_counts.size();
+  block_draws.resize(n_blocks);
+  std::mt19937_64 gen = ReplicateGenerator(seed, replicate, 0);
+  uint32_t reads_left = how_many;
+  uint64_t weight_left = counts_total;
+  for (uint32_t b = 0; b < n_blocks; ++b) {
+    block_draws[b] = DrawBinomial(reads_left, block_counts[b], weight_left, gen);
+    reads_left -= block_draws[b];
+    weight_left -= block_counts[b];
+  }
+
 #pragma omp parallel for schedule(static)
-  for (uint32_t i = 0; i < num_ecs(); ++i) {
-    log_ec_counts[i] = std::log(tmp_counts[i]);
+  for (uint32_t b = 0; b < n_blocks; ++b) {
+    std::mt19937_64 block_gen = ReplicateGenerator(seed, replicate, b + 1);
+    uint32_t block_reads_left = block_draws[b];
+    uint64_t block_weight_left = block_counts[b];
+    uint32_t block_end = std::min(num_ecs(), (b + 1)*RESAMPLE_BLOCK_SIZE);
+    for (uint32_t i = b*RESAMPLE_BLOCK_SIZE; i < block_end; ++i) {
+      uint32_t count = DrawBinomial(block_reads_left, weights[i], block_weight_left, block_gen);
+      block_reads_left -= count;
+      block_weight_left -= weights[i];
+      resampled_log_counts[i] = std::log(count);
+    }
   }
-  counts_total = how_many;
 }
 
-void BootstrapSample::BootstrapIter(const std::vector<double> &alpha0, const double tolerance, const uint16_t max_iters) {
-  // Process pseudoalignments but return the abundances rather than writing.
-  ec_probs = rcg_optl_mat(ll_mat, *this, alpha0, tolerance, max_iters);
-  this->relative_abundances.emplace_back(group_abundances());
+void BootstrapSample::InitBootstrap() {
+  uint32_t n_blocks = (num_ecs() + RESAMPLE_BLOCK_SIZE - 1)/RESAMPLE_BLOCK_SIZE;
+  block_counts.assign(n_blocks, 0);
+  for (uint32_t i = 0; i < num_ecs(); ++i) {
+    block_counts[i/RESAMPLE_BLOCK_SIZE] += pseudos.ec_counts[i];
+  }
 }
 
-void BootstrapSample::BootstrapAbundances(const Reference &reference, const Arguments &args) {
-  std::mt19937_64 gen;
-  if (args.seed == -1) {
-    std::random_device rd;
-    gen = std::mt19937_64(rd());
-  } else {
-    gen = std::mt19937_64(args.seed);
-  }
+void BootstrapSample::BootstrapAbundances(const Reference &reference, const Arguments &args, RcgWorkspace &workspace) {
+  uint32_t seed = (args.seed == -1 ? std::random_device()() : args.seed);
   std::cerr << "Running estimation with " << args.iters << " bootstrap iterations" << '\n';
   // Which sample are we processing?
   std::string name = (args.batch_mode ? cell_name() : "0");
   std::cout << "Processing " << (args.batch_mode ? name : "the sample") << std::endl;
-  // Init the bootstrap variables
-  InitBootstrap(reference.grouping);
-  //  bootstrap_abundances = std::vector<std::vector<double>>(args.iters, std::vector<double>());
-  for (unsigned i = 0; i <= args.iters; ++i) {
-    if (i > 0) {
-      std::cout << "Bootstrap" << " iter " << i << "/" << args.iters << std::endl;
+  relative_abundances.resize(args.iters + 1);
+
+  std::cerr << "Estimating relative abundances without bootstrapping" << std::endl;
+  rcg_optl_mat(*ll_mat, counts, log_ec_counts, counts_total, args.optimizer, nullptr, workspace, ec_probs, std::cerr);
+  relative_abundances[0] = group_abundances();
+  if (args.optimizer.write_probs && !args.outfile.empty()) {
+    std::string outfile = args.outfile;
+    std::unique_ptr<std::ostream> of;
+    if (args.optimizer.gzip_probs) {
+      outfile += "_probs.csv.gz";
+      of = OpenParallelGzipOutput(outfile, omp_get_max_threads());
     } else {
-      std::cerr << "Estimating relative abundances without bootstrapping" << std::endl;
+      outfile += "_probs.csv";
+      of = std::unique_ptr<std::ostream>(new std::ofstream(outfile));
     }
-    BootstrapIter(args.optimizer.alphas, args.optimizer.tolerance, args.optimizer.max_iters);
-
-    if (i == 0) {
-      if (args.optimizer.write_probs && !args.outfile.empty()) {
-	std::string outfile = args.outfile;
-	std::unique_ptr<std::ostream> of;
-	if (args.optimizer.gzip_probs) {
-	  outfile += "_probs.csv.gz";
-	  of = std::unique_ptr<std::ostream>(new bxz::ofstream(outfile));
-	} else {
-	  outfile += "_probs.csv";
-	  of = std::unique_ptr<std::ostream>(new std::ofstream(outfile));
-	}
-	write_probabilities(reference.group_names, args.optimizer.gzip_probs, (args.optimizer.print_probs ? std::cout : *of));
+    write_probabilities(reference.group_names, args.optimizer, (args.optimizer.print_probs ? std::cout : *of));
+    CloseOutput(*of, outfile);
+  }
+  if (args.iters == 0) {
+    return;
+  }
+
+  // Run as many replicates at a time as there are threads, the
+  // threads that are left over are used inside the optimizer. Each
+  // replicate starts from the estimate for the original counts and
+  // writes its progress only after it has finished.
+  unsigned n_inner;
+  unsigned n_concurrent = concurrent_estimations(args.iters, n_inner);
+  uint32_t how_many = (args.bootstrap_count == 0 ? counts_total : args.bootstrap_count);
+  std::cerr << "  running " << n_concurrent << " bootstrap iterations at a time with " << n_inner << " thread(s) each" << std::endl;
+  omp_set_max_active_levels(n_inner > 1 ? 2 : 1);
+
+#pragma omp parallel num_threads(n_concurrent)
+  {
+    omp_set_num_threads(n_inner);
+    BootstrapBuffers buffers;
+    buffers.log_ec_counts.resize(num_ecs());
+#pragma omp for schedule(dynamic)
+    for (unsigned i = 1; i <= args.iters; ++i) {
+      ResampleCounts(how_many, seed, i, buffers.block_draws, buffers.log_ec_counts);
+      std::ostringstream log;
+      rcg_optl_mat(*ll_mat, counts, buffers.log_ec_counts, how_many, args.optimizer, ec_probs.get(), buffers.workspace, buffers.ec_probs, log);
+      relative_abundances[i] = group_abundances(*buffers.ec_probs, buffers.log_ec_counts, how_many);
+#pragma omp critical(bootstrap_log)
+      {
+	std::cout << "Bootstrap" << " iter " << i << "/" << args.iters << std::endl;
+	std::cerr << log.str();
       }
     }
-    // Resample the pseudoalignment counts (here because we want to include the original)
-    ResampleCounts((args.bootstrap_count == 0 ? counts_total : args.bootstrap_count), gen);
   }
+  omp_set_max_active_levels(1);
 }
 
-
-void BootstrapSample::WriteBootstrap(const std::vector<std::string> &cluster_indicators_to_string, std::string &outfile, const unsigned iters, const bool batch_mode) const {
+void BootstrapSample::WriteBootstrap(const std::vector<std::string> &cluster_indicators_to_string, std::string &outfile, const unsigned iters, const bool batch_mode, const unsigned precision) const {
   // Write relative abundances to a file,
   // outputs to std::cout if outfile is empty.
   outfile = (outfile.empty() || !batch_mode ? outfile : outfile + '/' + cell_name());
@@ -92,12 +159,18 @@ void BootstrapSample::WriteBootstrap(const std::vector<std::string> &cluster_ind
   out << "#bootstrap_iters:" << '\t' << iters << '\n';
   out << "#c_id" << '\t' << "mean_theta" << '\t' << "bootstrap_mean_thetas" << '\n';
 
-  for (size_t i = 0; i < cluster_indicators_to_string.size(); ++i) {
-    out << cluster_indicators_to_string[i] << '\t';
-    for (unsigned j = 0; j <= iters; ++j) {
-      out << relative_abundances[j][i] << (j == iters ? '\n' : '\t');
+  const NumberFormat format(precision);
+  auto format_rows = [&](const size_t first, const size_t last, std::string *row) {
+    for (size_t i = first; i < last; ++i) {
+      *row += cluster_indicators_to_string[i];
+      for (unsigned j = 0; j <= iters; ++j) {
+	*row += '\t';
+	format.append(relative_abundances[j][i], row);
+      }
+      *row += '\n';
     }
-  }
+  };
+  WriteRows(cluster_indicators_to_string.size(), RowsPerBlock(12*(iters + 2)), format_rows, out);
   out << std::endl;
   if (!outfile.empty()) {
     of.close();
@@ -114,3 +187,16 @@ void BootstrapSample::read_kallisto(const uint32_t n_refs, std::istream &ec_file
   process_aln();
 }
 
+void BootstrapSample::read_kallisto_cell(const KallistoBatch &batch, const uint32_t cell) {
+  process_cell(batch, cell);
+}
+
+void BootstrapSample::stream_themisto(const std::string &merge_mode, const Grouping &grouping, std::istream &strand_1, std::istream &strand_2) {
+  GroupCountEcs ecs;
+  StreamThemisto(merge_mode, grouping, strand_1, strand_2, &ecs);
+  process_group_ecs(ecs);
+}
+
+void BootstrapSample::read_cache(const Grouping &grouping, const std::string &path) {
+  process_cache(grouping, path);
+}
@@ -1,6 +1,21 @@
 #include "Reference.hpp"
 
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+
+#include "likelihood.hpp"
+#include "cache.hpp"
+#include "reference_index.hpp"
+
 void Reference::calculate_bb_parameters(double params[2]) {
+  if (!this->grouping.bb_params.empty() && this->bb_params_from[0] == params[0] && this->bb_params_from[1] == params[1]) {
+    // Read from a reference index with the same parameters.
+    return;
+  }
+  this->grouping.bb_params.clear();
+  this->lls.reset();
+  this->bb_params_from = { { params[0], params[1] } };
   for (size_t i = 0; i < this->grouping.n_groups; ++i) {
     double e = this->grouping.sizes[i]*params[0];
     double phi = 1.0/(this->grouping.sizes[i] - e + params[1]);
@@ -9,3 +24,136 @@ void Reference::calculate_bb_parameters(double params[2]) {
     this->grouping.bb_params.emplace_back(std::array<double, 2>{ { alpha, beta } });
   }
 }
+
+std::shared_ptr<const Matrix<double>> Reference::likelihoods() const {
+  if (this->lls) {
+    return this->lls;
+  }
+  Matrix<double> *ll_mat = new Matrix<double>();
+  precalc_lls(this->grouping, ll_mat);
+  return std::shared_ptr<const Matrix<double>>(ll_mat);
+}
+
+void Reference::write_index(const std::string &path, const bool write_lls) const {
+  std::vector<uint64_t> name_offsets(1, 0);
+  std::string names;
+  for (size_t i = 0; i < this->group_names.size(); ++i) {
+    names += this->group_names[i];
+    name_offsets.emplace_back(names.size());
+  }
+  Matrix<double> ll_mat;
+  if (write_lls) {
+    precalc_lls(this->grouping, &ll_mat);
+  }
+
+  ReferenceIndexHeader header;
+  std::copy(INDEX_MAGIC, INDEX_MAGIC + 8, header.magic);
+  header.version = INDEX_VERSION;
+  header.n_groups = this->grouping.n_groups;
+  header.n_refs = this->grouping.indicators.size();
+  header.params[0] = this->bb_params_from[0];
+  header.params[1] = this->bb_params_from[1];
+  header.names_bytes = names.size();
+  header.lls_cols = (write_lls ? ll_mat.get_cols() : 0);
+
+  std::ofstream of(path, std::ios::binary);
+  if (!of.good()) {
+    throw std::runtime_error("File " + path + " is not writable (does the directory exist?).");
+  }
+  const char padding[8] = { 0 };
+  auto write_array = [&of, &padding](const void* data, const size_t n, const size_t size) {
+    of.write(static_cast<const char*>(data), n*size);
+    of.write(padding, CachePadded(n, size) - n*size);
+  };
+  of.write(reinterpret_cast<const char*>(&header), sizeof(ReferenceIndexHeader));
+  write_array(this->grouping.indicators.data(), header.n_refs, sizeof(uint32_t));
+  write_array(this->grouping.sizes.data(), header.n_groups, sizeof(uint16_t));
+  write_array(this->grouping.bb_params.data(), header.n_groups, 2*sizeof(double));
+  write_array(name_offsets.data(), header.n_groups + 1, sizeof(uint64_t));
+  write_array(names.data(), names.size(), 1);
+  std::vector<double> ll_row(header.lls_cols);
+  for (uint32_t i = 0; i < header.n_groups && write_lls; ++i) {
+    for (uint32_t j = 0; j < header.lls_cols; ++j) {
+      ll_row[j] = ll_mat(i, j);
+    }
+    write_array(ll_row.data(), ll_row.size(), sizeof(double));
+  }
+  if (!of.good()) {
+    throw std::runtime_error("Writing the reference index to " + path + " failed.");
+  }
+}
+
+void Reference::read_index(const std::string &path) {
+  MappedFile index(path);
+  const ReferenceIndexHeader* header = reinterpret_cast<const ReferenceIndexHeader*>(index.data());
+  if (index.size() < sizeof(ReferenceIndexHeader) || !std::equal(INDEX_MAGIC, INDEX_MAGIC + 8, header->magic) || header->version != INDEX_VERSION) {
+    throw std::runtime_error("File: " + path + " is not an mSWEEP reference index.");
+  }
+  // Bounded by the file size first so that the sizes below can't overflow.
+  if (header->n_groups > index.size() || header->n_refs > index.size() || header->names_bytes > index.size() || header->lls_cols > index.size()
+      || (header->n_groups > 0 && CachePadded(header->lls_cols, sizeof(double)) > index.size()/header->n_groups)) {
+    throw std::runtime_error("Reference index: " + path + " is truncated.");
+  }
+  size_t expected_size = sizeof(ReferenceIndexHeader) + CachePadded(header->n_refs, sizeof(uint32_t)) + CachePadded(header->n_groups, sizeof(uint16_t))
+    + CachePadded(header->n_groups, 2*sizeof(double)) + CachePadded(header->n_groups + 1, sizeof(uint64_t)) + CachePadded(header->names_bytes, 1)
+    + header->n_groups*CachePadded(header->lls_cols, sizeof(double));
+  if (index.size() != expected_size) {
+    throw std::runtime_error("Reference index: " + path + " is truncated.");
+  }
+
+  const char* pos = index.data() + sizeof(ReferenceIndexHeader);
+  const uint32_t* indicators = reinterpret_cast<const uint32_t*>(pos);
+  pos += CachePadded(header->n_refs, sizeof(uint32_t));
+  const uint16_t* sizes = reinterpret_cast<const uint16_t*>(pos);
+  pos += CachePadded(header->n_groups, sizeof(uint16_t));
+  const double* bb_params = reinterpret_cast<const double*>(pos);
+  pos += CachePadded(header->n_groups, 2*sizeof(double));
+  const uint64_t* name_offsets = reinterpret_cast<const uint64_t*>(pos);
+  pos += CachePadded(header->n_groups + 1, sizeof(uint64_t));
+  const char* names = pos;
+  pos += CachePadded(header->names_bytes, 1);
+
+  // The indicators and sizes index the likelihoods and the group names
+  // slice the name block, so check them against each other.
+  std::vector<uint16_t> group_sizes(header->n_groups, 0);
+  for (uint64_t r = 0; r < header->n_refs; ++r) {
+    if (indicators[r] >= header->n_groups) {
+      throw std::runtime_error("Reference index: " + path + " is corrupted.");
+    }
+    ++group_sizes[indicators[r]];
+  }
+  uint16_t max_size = 0;
+  for (uint32_t i = 0; i < header->n_groups; ++i) {
+    if (sizes[i] != group_sizes[i] || name_offsets[i] > name_offsets[i + 1]) {
+      throw std::runtime_error("Reference index: " + path + " is corrupted.");
+    }
+    max_size = std::max(max_size, sizes[i]);
+  }
+  if (name_offsets[0] != 0 || name_offsets[header->n_groups] > header->names_bytes || (header->lls_cols > 0 && header->lls_cols < (uint64_t)max_size + 1)) {
+    throw std::runtime_error("Reference index: " + path + " is corrupted.");
+  }
+
+  this->grouping.n_groups = header->n_groups;
+  this->grouping.indicators.assign(indicators, indicators + header->n_refs);
+  this->grouping.sizes.assign(sizes, sizes + header->n_groups);
+  this->grouping.bb_params.resize(header->n_groups);
+  this->group_names.resize(header->n_groups);
+  for (uint32_t i = 0; i < header->n_groups; ++i) {
+    this->grouping.bb_params[i] = { { bb_params[2*i], bb_params[2*i + 1] } };
+    this->group_names[i].assign(names + name_offsets[i], names + name_offsets[i + 1]);
+  }
+  this->bb_params_from = { { header->params[0], header->params[1] } };
+  this->n_refs = header->n_refs;
+
+  if (header->lls_cols > 0) {
+    Matrix<double> *ll_mat = new Matrix<double>(header->n_groups, header->lls_cols, 0.0);
+    const double* ll_rows = reinterpret_cast<const double*>(pos);
+    size_t row_stride = CachePadded(header->lls_cols, sizeof(double))/sizeof(double);
+    for (uint32_t i = 0; i < header->n_groups; ++i) {
+      for (uint32_t j = 0; j < header->lls_cols; ++j) {
+	(*ll_mat)(i, j) = ll_rows[i*row_stride + j];
+      }
+    }
+    this->lls.reset(ll_mat);
+  }
+}
@@ -1,6 +1,18 @@
 #include "Sample.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
 #include "likelihood.hpp"
+#include "KallistoBatch.hpp"
+#include "ThemistoStream.hpp"
+#include "cache.hpp"
+#include "read_bitfield.hpp"
+#include "output_format.hpp"
 #include "version.h"
 
 void Sample::process_aln() {
@@ -17,6 +29,162 @@ void Sample::process_aln() {
   counts_total = aln_counts_total;
 }
 
+void Sample::process_cell(const KallistoBatch &batch, const uint32_t cell) {
+  const std::vector<std::pair<uint32_t, uint32_t>> &cell_counts = batch.cell_counts[cell];
+  cell_id = batch.cell_names[cell];
+  m_num_ecs = cell_counts.size();
+  m_num_refs = 0;
+  pseudos.ec_ids.resize(m_num_ecs);
+  pseudos.ec_counts.resize(m_num_ecs);
+  log_ec_counts.resize(m_num_ecs);
+  counts_total = 0;
+  std::vector<uint32_t> n_hits(m_num_ecs);
+  for (uint32_t j = 0; j < m_num_ecs; ++j) {
+    uint32_t ec = cell_counts[j].first;
+    pseudos.ec_ids[j] = batch.ec_ids[ec];
+    pseudos.ec_counts[j] = cell_counts[j].second;
+    log_ec_counts[j] = std::log(cell_counts[j].second);
+    counts_total += cell_counts[j].second;
+    n_hits[j] = batch.counts.col_end(ec) - batch.counts.col_start(ec);
+  }
+  counts.allocate(batch.counts.get_rows(), n_hits);
+  for (uint32_t j = 0; j < m_num_ecs; ++j) {
+    size_t pos = counts.col_start(j);
+    uint32_t ec = cell_counts[j].first;
+    for (size_t k = batch.counts.col_start(ec); k < batch.counts.col_end(ec); ++k) {
+      counts.row_id(pos) = batch.counts.row_id(k);
+      counts.value(pos) = batch.counts.value(k);
+      ++pos;
+    }
+  }
+}
+
+void Sample::process_group_ecs(GroupCountEcs &ecs) {
+  m_num_ecs = ecs.ec_counts.size();
+  m_num_refs = 0;
+  pseudos.ec_ids.resize(m_num_ecs);
+  log_ec_counts.resize(m_num_ecs);
+  counts_total = 0;
+  for (uint32_t j = 0; j < m_num_ecs; ++j) {
+    pseudos.ec_ids[j] = j;
+    log_ec_counts[j] = std::log(ecs.ec_counts[j]);
+    counts_total += ecs.ec_counts[j];
+  }
+  pseudos.ec_counts.swap(ecs.ec_counts);
+  counts = std::move(ecs.counts);
+}
+
+void Sample::process_cache(const Grouping &grouping, const std::string &path) {
+  MappedFile cache(path);
+  const CacheHeader* header = reinterpret_cast<const CacheHeader*>(cache.data());
+  if (cache.size() < sizeof(CacheHeader) || !std::equal(CACHE_MAGIC, CACHE_MAGIC + 8, header->magic) || header->version != CACHE_VERSION) {
+    throw std::runtime_error("File: " + path + " is not an mSWEEP cache.");
+  }
+  if (header->n_groups != grouping.n_groups || header->n_refs != grouping.indicators.size() || header->fingerprint != GroupingFingerprint(grouping)) {
+    throw std::runtime_error("Cache: " + path + " was written with a different grouping.");
+  }
+  // Bounded by the file size first so that the sizes below can't overflow.
+  if (header->n_ecs > cache.size() || header->n_hits_total > cache.size()) {
+    throw std::runtime_error("Cache: " + path + " is truncated.");
+  }
+  if (header->n_ecs > std::numeric_limits<uint32_t>::max() || header->counts_total > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("Cache: " + path + " is corrupted.");
+  }
+  size_t ec_bytes = CachePadded(header->n_ecs, sizeof(uint32_t));
+  size_t expected_size = sizeof(CacheHeader) + 3*ec_bytes + CachePadded(header->n_hits_total, sizeof(uint32_t)) + CachePadded(header->n_hits_total, sizeof(uint16_t));
+  if (cache.size() != expected_size) {
+    throw std::runtime_error("Cache: " + path + " is truncated.");
+  }
+
+  m_num_ecs = header->n_ecs;
+  m_num_refs = header->n_refs;
+  counts_total = header->counts_total;
+  const char* pos = cache.data() + sizeof(CacheHeader);
+  const uint32_t* ec_ids = reinterpret_cast<const uint32_t*>(pos);
+  const uint32_t* ec_counts = reinterpret_cast<const uint32_t*>(pos + ec_bytes);
+  const uint32_t* n_hits = reinterpret_cast<const uint32_t*>(pos + 2*ec_bytes);
+  pos += 3*ec_bytes;
+  const uint32_t* row_ids = reinterpret_cast<const uint32_t*>(pos);
+  const uint16_t* values = reinterpret_cast<const uint16_t*>(pos + CachePadded(header->n_hits_total, sizeof(uint32_t)));
+
+  // The hits are used as indices into the likelihoods, so each
+  // equivalence class must hit distinct groups in increasing order
+  // and at most as many references as the group has.
+  uint64_t hits_total = 0;
+  uint64_t reads_total = 0;
+  for (uint32_t j = 0; j < m_num_ecs; ++j) {
+    if (ec_counts[j] == 0 || n_hits[j] > grouping.n_groups || n_hits[j] > header->n_hits_total - hits_total) {
+      throw std::runtime_error("Cache: " + path + " is corrupted.");
+    }
+    for (uint64_t k = hits_total; k < hits_total + n_hits[j]; ++k) {
+      if (row_ids[k] >= grouping.n_groups || (k > hits_total && row_ids[k] <= row_ids[k - 1]) || values[k] == 0 || values[k] > grouping.sizes[row_ids[k]]) {
+	throw std::runtime_error("Cache: " + path + " is corrupted.");
+      }
+    }
+    hits_total += n_hits[j];
+    reads_total += ec_counts[j];
+  }
+  if (hits_total != header->n_hits_total || reads_total != header->counts_total) {
+    throw std::runtime_error("Cache: " + path + " is corrupted.");
+  }
+
+  pseudos.ec_ids.assign(ec_ids, ec_ids + m_num_ecs);
+  pseudos.ec_counts.assign(ec_counts, ec_counts + m_num_ecs);
+  log_ec_counts.resize(m_num_ecs);
+  for (uint32_t j = 0; j < m_num_ecs; ++j) {
+    log_ec_counts[j] = std::log(ec_counts[j]);
+  }
+  counts.allocate(grouping.n_groups, std::vector<uint32_t>(n_hits, n_hits + m_num_ecs));
+  for (size_t k = 0; k < counts.nnz(); ++k) {
+    counts.row_id(k) = row_ids[k];
+  }
+  std::copy(values, values + counts.nnz(), counts.data());
+}
+
+void Sample::read_cache(const Grouping &grouping, const std::string &path) {
+  process_cache(grouping, path);
+  pseudos.ec_counts.clear();
+}
+
+void Sample::write_cache(const Grouping &grouping, const std::string &path) const {
+  CacheHeader header;
+  std::copy(CACHE_MAGIC, CACHE_MAGIC + 8, header.magic);
+  header.version = CACHE_VERSION;
+  header.n_groups = grouping.n_groups;
+  header.n_refs = grouping.indicators.size();
+  header.fingerprint = GroupingFingerprint(grouping);
+  header.n_ecs = m_num_ecs;
+  header.n_hits_total = counts.nnz();
+  header.counts_total = counts_total;
+
+  std::vector<uint32_t> ec_counts(m_num_ecs);
+  std::vector<uint32_t> n_hits(m_num_ecs);
+  for (uint32_t j = 0; j < m_num_ecs; ++j) {
+    // Samples that are not bootstrapped only keep the log counts.
+    ec_counts[j] = (pseudos.ec_counts.empty() ? std::lround(std::exp(log_ec_counts[j])) : pseudos.ec_counts[j]);
+    n_hits[j] = counts.col_end(j) - counts.col_start(j);
+  }
+
+  std::ofstream of(path, std::ios::binary);
+  if (!of.good()) {
+    throw std::runtime_error("File " + path + " is not writable (does the directory exist?).");
+  }
+  const char padding[8] = { 0 };
+  auto write_array = [&of, &padding](const void* data, const size_t n, const size_t size) {
+    of.write(static_cast<const char*>(data), n*size);
+    of.write(padding, CachePadded(n, size) - n*size);
+  };
+  of.write(reinterpret_cast<const char*>(&header), sizeof(CacheHeader));
+  write_array(pseudos.ec_ids.data(), m_num_ecs, sizeof(uint32_t));
+  write_array(ec_counts.data(), m_num_ecs, sizeof(uint32_t));
+  write_array(n_hits.data(), m_num_ecs, sizeof(uint32_t));
+  write_array(counts.row_ids().data(), counts.nnz(), sizeof(uint32_t));
+  write_array(counts.data(), counts.nnz(), sizeof(uint16_t));
+  if (!of.good()) {
+    throw std::runtime_error("Writing the cache to " + path + " failed.");
+  }
+}
+
 void Sample::read_themisto(const Mode &mode, const uint32_t n_refs, std::vector<std::istream*> &strands) {
   ReadThemisto(mode, n_refs, strands, &pseudos);
   process_aln();
@@ -29,51 +197,110 @@ void Sample::read_kallisto(const uint32_t n_refs, std::istream &ec_file, std::is
   pseudos.ec_counts.clear();
 }
 
+void Sample::read_kallisto_cell(const KallistoBatch &batch, const uint32_t cell) {
+  process_cell(batch, cell);
+  pseudos.ec_counts.clear();
+}
+
+void Sample::stream_themisto(const std::string &merge_mode, const Grouping &grouping, std::istream &strand_1, std::istream &strand_2) {
+  GroupCountEcs ecs;
+  StreamThemisto(merge_mode, grouping, strand_1, strand_2, &ecs);
+  process_group_ecs(ecs);
+  pseudos.ec_counts.clear();
+}
+
+std::vector<double> Sample::group_abundances(const Posterior &probs, const std::vector<double> &log_counts, const uint32_t total) {
+  std::vector<double> thetas(probs.get_rows(), 0.0);
+  probs.exp_right_multiply(log_counts, thetas);
+  for (uint32_t i = 0; i < probs.get_rows(); ++i) {
+    thetas[i] /= total;
+  }
+  return thetas;
+}
+
 std::vector<double> Sample::group_abundances() const {
   // Calculate the relative abundances of the
   // reference groups from the ec_probs matrix
-  std::vector<double> thetas(this->ec_probs.get_rows(), 0.0);
-  for (uint32_t i = 0; i < this->ec_probs.get_rows(); ++i) {
-    for (uint32_t j = 0; j < this->ec_probs.get_cols(); ++j) {
-      thetas[i] += std::exp(this->ec_probs(i, j) + this->log_ec_counts[j]);
-    }
-    thetas[i] /= this->counts_total;
-  }
-  return thetas;
+  return group_abundances(*this->ec_probs, this->log_ec_counts, this->counts_total);
 }
 
-std::vector<uint16_t> Sample::group_counts(const std::vector<uint32_t> indicators, const uint32_t ec_id, const uint32_t n_groups) const {
-  std::vector<uint16_t> read_hitcounts(n_groups);
-  for (uint32_t j = 0; j < m_num_refs; ++j) {
-    read_hitcounts[indicators[j]] += pseudos.ec_configs[ec_id][j];
+void Sample::write_sparse_probabilities(const std::vector<std::string> &cluster_indicators_to_string, const unsigned top_k, const double min_prob, const NumberFormat &format, std::ostream &of) const {
+  // Write the kept probabilities of each equivalence class, the top k
+  // in decreasing order.
+  if (of.good()) {
+    of << "ec_id" << ',' << "group" << ',' << "probability" << '\n';
+    uint32_t n_groups = this->ec_probs->get_rows();
+    uint32_t n_kept = (top_k == 0 ? n_groups : std::min(top_k, n_groups));
+    double log_min = (min_prob > 0.0 ? std::log(min_prob) : -std::numeric_limits<double>::infinity());
+    auto format_rows = [&](const size_t first, const size_t last, std::string *buf) {
+      std::vector<double> col(n_groups);
+      std::vector<uint32_t> order(n_groups);
+      for (size_t i = first; i < last; ++i) {
+	this->ec_probs->fill_col(i, col.data());
+	std::iota(order.begin(), order.end(), 0);
+	if (n_kept < n_groups) {
+	  auto more_probable = [&col](const uint32_t a, const uint32_t b) { return col[a] > col[b]; };
+	  std::nth_element(order.begin(), order.begin() + n_kept, order.end(), more_probable);
+	  std::sort(order.begin(), order.begin() + n_kept, more_probable);
+	}
+	for (uint32_t k = 0; k < n_kept; ++k) {
+	  if (col[order[k]] >= log_min) {
+	    format.append(pseudos.ec_ids[i], buf);
+	    *buf += ',';
+	    *buf += cluster_indicators_to_string[order[k]];
+	    *buf += ',';
+	    format.append(std::exp(col[order[k]]), buf);
+	    *buf += '\n';
+	  }
+	}
+      }
+    };
+    WriteRows(this->ec_probs->get_cols(), RowsPerBlock(32*n_kept), format_rows, of);
   }
-  return read_hitcounts;
+  of << std::endl;
+  of.flush();
 }
 
-void Sample::write_probabilities(const std::vector<std::string> &cluster_indicators_to_string, const bool gzip_probs, std::ostream &of) const {
+void Sample::write_probabilities(const std::vector<std::string> &cluster_indicators_to_string, const OptimizerArgs &args, std::ostream &of) const {
+  const NumberFormat format(args.precision);
+  if (args.probs_top_k > 0 || args.probs_min > 0.0) {
+    write_sparse_probabilities(cluster_indicators_to_string, args.probs_top_k, args.probs_min, format, of);
+    return;
+  }
   // Write the probability matrix to a file.
   if (of.good()) {
-    of << "ec_id" << ',';
-    for (uint32_t i = 0; i < this->ec_probs.get_rows(); ++i) {
-      of << cluster_indicators_to_string[i];
-      of << (i < this->ec_probs.get_rows() - 1 ? ',' : '\n');
+    uint32_t n_groups = this->ec_probs->get_rows();
+    std::string header("ec_id");
+    for (uint32_t i = 0; i < n_groups; ++i) {
+      header += ',';
+      header += cluster_indicators_to_string[i];
     }
-    for (uint32_t i = 0; i < this->ec_probs.get_cols(); ++i) {
-      of << pseudos.ec_ids[i] << ',';
-      for (uint32_t j = 0; j < this->ec_probs.get_rows(); ++j) {
-	of << std::exp(this->ec_probs(j, i));
-	of << (j < this->ec_probs.get_rows() - 1 ? ',' : '\n');
+    header += '\n';
+    of.write(header.data(), header.size());
+
+    auto format_rows = [&](const size_t first, const size_t last, std::string *buf) {
+      std::vector<double> col(n_groups);
+      for (size_t i = first; i < last; ++i) {
+	format.append(pseudos.ec_ids[i], buf);
+	this->ec_probs->fill_col(i, col.data());
+	for (uint32_t j = 0; j < n_groups; ++j) {
+	  *buf += ',';
+	  format.append(std::exp(col[j]), buf);
+	}
+	*buf += '\n';
       }
-    }
+    };
+    WriteRows(this->ec_probs->get_cols(), RowsPerBlock(12*(n_groups + 1)), format_rows, of);
   }
   of << std::endl;
   of.flush();
 }
 
-void Sample::write_abundances(const std::vector<std::string> &cluster_indicators_to_string, std::string outfile) const {
+void Sample::write_abundances(const std::vector<std::string> &cluster_indicators_to_string, const OptimizerArgs &args, std::string outfile) const {
   // Write relative abundances to a file,
   // outputs to std::cout if outfile is empty.
   const std::vector<double> &abundances = this->group_abundances();
+  const NumberFormat format(args.precision);
 
   std::streambuf *buf;
   std::ofstream of;
@@ -88,23 +315,68 @@ void Sample::write_abundances(const std::vector<std::string> &cluster_indicators
   out << "#mSWEEP_version:" << '\t' << MSWEEP_BUILD_VERSION << '\n';
   out << "#total_hits:" << '\t' << this->counts_total << '\n';
   out << "#c_id" << '\t' << "mean_theta" << '\n';
-  for (size_t i = 0; i < abundances.size(); ++i) {
-    out << cluster_indicators_to_string[i] << '\t' << abundances[i] << '\n';
-  }
+  auto format_rows = [&](const size_t first, const size_t last, std::string *row) {
+    for (size_t i = first; i < last; ++i) {
+      *row += cluster_indicators_to_string[i];
+      *row += '\t';
+      format.append(abundances[i], row);
+      *row += '\n';
+    }
+  };
+  WriteRows(abundances.size(), RowsPerBlock(64), format_rows, out);
   if (!outfile.empty()) {
     of.close();
   }
 }
 
-void Sample::CalcLikelihood(const Grouping &grouping) {
-  precalc_lls(grouping, &ll_mat);
+void Sample::CalcLikelihood(const Grouping &grouping, const std::shared_ptr<const Matrix<double>> &lls) {
+  ll_mat = lls;
+  count_groups(grouping);
+}
 
-  counts.resize(grouping.n_groups, std::vector<uint16_t>(m_num_ecs, 0));
-#pragma omp parallel for schedule(static)
-  for (uint32_t j = 0; j < m_num_ecs; ++j) {
-    const std::vector<uint16_t> &groupcounts = group_counts(grouping.indicators, j, grouping.n_groups);
-    for (uint32_t i = 0; i < grouping.n_groups; ++i) {
-      counts[i][j] = groupcounts[i];
+void Sample::count_groups(const Grouping &grouping) {
+  if (counts.get_cols() == m_num_ecs) {
+    // Counted already or when reading the sample.
+    return;
+  }
+
+  // Each alignment is visited once. The references it hits are
+  // counted per group in a buffer of the thread, which does not depend
+  // on the order of the references in the alignment. The hit groups
+  // are appended to flat buffers of the thread. A static schedule
+  // gives each thread one contiguous range of ECs, so its buffers are
+  // copied as one block into the counts once the columns are sized.
+  std::vector<uint32_t> n_hits(m_num_ecs, 0);
+#pragma omp parallel
+  {
+    std::vector<uint16_t> group_hits(grouping.n_groups, 0);
+    std::vector<uint32_t> hit_groups;
+    std::vector<uint16_t> hit_counts;
+    uint32_t first_ec = m_num_ecs;
+#pragma omp for schedule(static)
+    for (uint32_t j = 0; j < m_num_ecs; ++j) {
+      first_ec = std::min(first_ec, j);
+      const auto &config = pseudos.ec_configs[j];
+      for (uint32_t k = 0; k < grouping.indicators.size(); ++k) {
+	group_hits[grouping.indicators[k]] += config[k];
+      }
+      for (uint32_t i = 0; i < grouping.n_groups; ++i) {
+	if (group_hits[i] > 0) {
+	  hit_groups.emplace_back(i);
+	  hit_counts.emplace_back(group_hits[i]);
+	  ++n_hits[j];
+	  group_hits[i] = 0;
+	}
+      }
+    }
+#pragma omp single
+    counts.allocate(grouping.n_groups, n_hits);
+    if (!hit_groups.empty()) {
+      size_t pos = counts.col_start(first_ec);
+      for (size_t k = 0; k < hit_groups.size(); ++k) {
+	counts.row_id(pos + k) = hit_groups[k];
+	counts.value(pos + k) = hit_counts[k];
+      }
     }
   }
   clear_configs();
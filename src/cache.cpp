@@ -0,0 +1,52 @@
+#include "cache.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+uint64_t GroupingFingerprint(const Grouping &grouping) {
+  // FNV-1a over the number of groups and the indicators.
+  uint64_t hash = 14695981039346656037ULL;
+  auto add = [&hash](const uint32_t value) {
+    for (unsigned k = 0; k < 4; ++k) {
+      hash ^= (value >> (8*k)) & 0xff;
+      hash *= 1099511628211ULL;
+    }
+  };
+  add(grouping.n_groups);
+  for (size_t i = 0; i < grouping.indicators.size(); ++i) {
+    add(grouping.indicators[i]);
+  }
+  return hash;
+}
+
+MappedFile::MappedFile(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::runtime_error("Cannot read from file: " + path + ".");
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    throw std::runtime_error("Cannot read from file: " + path + ".");
+  }
+  m_size = st.st_size;
+  if (m_size > 0) {
+    void* mapped = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Cannot map file: " + path + " into memory.");
+    }
+    m_data = static_cast<const char*>(mapped);
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (m_data != nullptr) {
+    munmap(const_cast<char*>(m_data), m_size);
+  }
+}
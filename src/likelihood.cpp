@@ -1,31 +1,55 @@
 #include "likelihood.hpp"
 
 #include <vector>
+#include <array>
+#include <map>
 #include <cmath>
+#include <limits>
+#include <utility>
 
-inline double lbeta(double x, double y) {
-  return(std::lgamma(x) + std::lgamma(y) - std::lgamma(x + y));
-}
-
-inline double log_bin_coeff(uint16_t n, uint16_t k) {
-  return (std::lgamma(n + 1) - std::lgamma(k + 1) - std::lgamma(n - k + 1));
-}
-
-inline double ldbb_scaled(uint16_t k, uint16_t n, double alpha, double beta) {
-  return (log_bin_coeff(n, k) + lbeta(k + alpha, n - k + beta) - lbeta(n + alpha, beta));
-}
+#include "special_functions.hpp"
 
 void precalc_lls(const Grouping &grouping, Matrix<double> *ll_mat) {
+  // Scaled beta-binomial log-likelihood of k hits to a group of n
+  // references with parameters (a, b):
+  //   log(n!) - log(k!) - log((n - k)!) + lbeta(k + a, n - k + b) - lbeta(n + a, b)
+  // The lgamma(n + a + b) terms of the two lbetas cancel, so each cell
+  // needs lgamma(k + a) and lgamma(n - k + b) and the rest depends only
+  // on the group. k > n is impossible and has likelihood 0.
   uint16_t max_size = 0;
   for (uint32_t i = 0; i < grouping.n_groups; ++i) {
     max_size = (grouping.sizes[i] > max_size ? grouping.sizes[i] : max_size);
   }
+  const std::vector<double> log_fact = log_factorials(max_size);
 
-  ll_mat->resize(grouping.n_groups, max_size + 1, -4.60517);
-#pragma omp parallel for schedule(static)
+  // Groups with the same size and parameters have the same row, which
+  // is computed only for the first of them.
+  std::vector<uint32_t> first_same(grouping.n_groups);
+  std::vector<double> group_const(grouping.n_groups);
+  std::map<std::pair<uint16_t, std::array<double, 2>>, uint32_t> seen;
   for (uint32_t i = 0; i < grouping.n_groups; ++i) {
-    for (uint16_t j = 1; j <= max_size; ++j) {
-      (*ll_mat)(i, j) = ldbb_scaled(j, grouping.sizes[i], grouping.bb_params[i][0], grouping.bb_params[i][1]) - 0.01005034; // log(0.99) = -0.01005034
+    first_same[i] = seen.emplace(std::make_pair(grouping.sizes[i], grouping.bb_params[i]), i).first->second;
+    if (first_same[i] == i) {
+      uint16_t n = grouping.sizes[i];
+      const std::array<double, 2> &ab = grouping.bb_params[i];
+      group_const[i] = log_fact[n] - std::lgamma(n + ab[0]) - std::lgamma(ab[1]) - 0.01005034; // log(0.99) = -0.01005034
+    }
+  }
+
+  ll_mat->resize(grouping.n_groups, max_size + 1, -4.60517);
+  // The work in a column shrinks as the small groups run out of hits.
+#pragma omp parallel for schedule(dynamic)
+  for (uint32_t j = 1; j <= max_size; ++j) {
+    for (uint32_t i = 0; i < grouping.n_groups; ++i) {
+      uint16_t n = grouping.sizes[i];
+      if (first_same[i] != i) {
+	(*ll_mat)(i, j) = (*ll_mat)(first_same[i], j);
+      } else if (j > n) {
+	(*ll_mat)(i, j) = -std::numeric_limits<double>::infinity();
+      } else {
+	const std::array<double, 2> &ab = grouping.bb_params[i];
+	(*ll_mat)(i, j) = group_const[i] - log_fact[j] - log_fact[n - j] + std::lgamma(j + ab[0]) + std::lgamma(n - j + ab[1]);
+      }
     }
   }
 }
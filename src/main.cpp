@@ -31,8 +31,12 @@ int main (int argc, char *argv[]) {
     return 1;
   }
   catch (std::invalid_argument &e) {
-    std::cerr << e.what() << std::endl;
-    PrintHelpMessage();
+    if (std::string(e.what()) == "index") {
+      PrintIndexHelpMessage();
+    } else {
+      std::cerr << e.what() << std::endl;
+      PrintHelpMessage();
+    }
     return 0;
   }
 
@@ -45,21 +49,42 @@ int main (int argc, char *argv[]) {
   try {
     std::cerr << "Reading the input files" << '\n';
     std::cerr << "  reading group indicators" << '\n';
-    if (args.fasta_file.empty()) {
+    if (!args.reference_index.empty()) {
+      reference.read_index(args.reference_index);
+    } else if (args.fasta_file.empty()) {
       File::In indicators_file(args.indicators_file);
       ReadClusterIndicators(indicators_file.stream(), reference);
     } else {
       File::In groups_file(args.groups_list_file);
-      File::In fasta_file(args.fasta_file);
-      MatchClusterIndicators(args.groups_list_delimiter, groups_file.stream(), fasta_file.stream(), reference);
+      MatchClusterIndicators(args.groups_list_delimiter, groups_file.stream(), args.fasta_file, reference);
     }
     if (reference.n_refs == 0) {
       throw std::runtime_error("The grouping contains 0 reference sequences");
     }
     std::cerr << "  read " << reference.n_refs << " group indicators" << std::endl;
 
+    if (args.index_mode) {
+      std::cerr << "Writing the reference index to " << args.outfile << std::endl;
+      reference.calculate_bb_parameters(args.params);
+      reference.write_index(args.outfile, args.index_lls);
+      return 0;
+    }
+
+    if (!args.manifest_file.empty()) {
+      std::vector<ManifestEntry> manifest;
+      File::In manifest_file(args.manifest_file);
+      ReadManifest(manifest_file.stream(), &manifest);
+      std::cerr << "  read " << manifest.size() << " samples from the manifest" << std::endl;
+      reference.calculate_bb_parameters(args.params);
+      args.optimizer.alphas = std::vector<double>(reference.grouping.n_groups, 1.0);
+      ProcessManifest(reference, args, manifest);
+      return 0;
+    }
+
     std::cerr << "  reading pseudoalignments" << '\n';
-    if (!args.themisto_mode) {
+    if (!args.cache_infile.empty()) {
+      ReadCachedBitfield(args.cache_infile, args.bootstrap_mode, reference.grouping, bitfields);
+    } else if (!args.themisto_mode) {
       // Check that the number of reference sequences matches in the grouping and the alignment.
       VerifyGrouping(reference.n_refs, *args.infiles.run_info);
       ReadBitfield(args.infiles, reference.n_refs, bitfields, reference, args.bootstrap_mode);
@@ -68,7 +93,17 @@ int main (int argc, char *argv[]) {
 	File::In themisto_index(args.themisto_index_path + "/coloring-names.txt");
 	VerifyThemistoGrouping(reference.n_refs, themisto_index.stream());
       }
-      ReadBitfield(args.tinfile1, args.tinfile2, args.themisto_merge_mode, args.bootstrap_mode, reference.n_refs, bitfields);
+      if (args.themisto_stream) {
+	StreamBitfield(args.tinfile1, args.tinfile2, args.themisto_merge_mode, args.bootstrap_mode, reference.grouping, args.optimizer.nr_threads, bitfields);
+      } else {
+	ReadBitfield(args.tinfile1, args.tinfile2, args.themisto_merge_mode, args.bootstrap_mode, reference.n_refs, args.optimizer.nr_threads, bitfields);
+      }
+    }
+
+    if (!args.cache_outfile.empty()) {
+      std::cerr << "  writing the pseudoalignments to " << args.cache_outfile << '\n';
+      bitfields[0]->count_groups(reference.grouping);
+      bitfields[0]->write_cache(reference.grouping, args.cache_outfile);
     }
 
     std::cerr << "  read " << (args.batch_mode ? bitfields.size() : bitfields[0]->num_ecs()) << (args.batch_mode ? " samples from the batch" : " unique alignments") << std::endl;
@@ -86,11 +121,18 @@ int main (int argc, char *argv[]) {
   args.optimizer.alphas = std::vector<double>(reference.grouping.n_groups, 1.0);
 
   // Process the reads accordingly
-  switch(args.run_mode()) {
-  case 0: ProcessReads(reference, args.outfile, *bitfields[0], args.optimizer); break;
-  case 1: ProcessBatch(reference, args, bitfields); break;
-  case 2: ProcessBootstrap(reference, args, bitfields); break;
-  case 3: ProcessBootstrap(reference, args, bitfields); break; // Same function for batch and single files
+  try {
+    switch(args.run_mode()) {
+    case 0: ProcessReads(reference, args.outfile, *bitfields[0], args.optimizer); break;
+    case 1: ProcessBatch(reference, args, bitfields); break;
+    case 2: ProcessBootstrap(reference, args, bitfields); break;
+    case 3: ProcessBootstrap(reference, args, bitfields); break; // Same function for batch and single files
+    }
+  } catch (std::runtime_error &e) {
+    std::cerr << "Estimating the relative abundances failed:\n  ";
+    std::cerr << e.what();
+    std::cerr << "\nexiting" << std::endl;
+    return 1;
   }
 
   return 0;
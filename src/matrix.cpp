@@ -3,148 +3,151 @@
 #include "matrix.hpp"
 
 #include <cmath>
+#include <algorithm>
 
 #include "openmp_config.hpp"
+#include "vmath.hpp"
 
 // Parameter Constructor
-template<typename T>
-Matrix<T>::Matrix(unsigned _rows, unsigned _cols, const T& _initial) {
-  mat.resize(_rows);
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout>::Matrix(unsigned _rows, unsigned _cols, const T& _initial) {
+  // Elements are left uninitialized by resize and filled in parallel
+  // so that the pages are first touched by the threads using them.
+  size_t n_elems = (size_t)_rows*_cols;
+  mat.resize(n_elems);
 #pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < mat.size(); i++) {
-    mat[i].resize(_cols, _initial);
+  for (size_t i = 0; i < n_elems; i++) {
+    mat[i] = _initial;
   }
   rows = _rows;
   cols = _cols;
 }
 
 // Copy constructor
-template<typename T>
-Matrix<T>::Matrix(const Matrix<T>& rhs) {
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout>::Matrix(const Matrix<T, Layout>& rhs) {
   mat = rhs.mat;
   rows = rhs.get_rows();
   cols = rhs.get_cols();
 }
 
 // (Virtual) Destructor
-template<typename T>
-Matrix<T>::~Matrix() {}
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout>::~Matrix() {}
 
 // Resize a matrix
-template<typename T>
-void Matrix<T>::resize(const uint32_t new_rows, const uint32_t new_cols, const T initial) {
-  if (new_rows != rows) {
-    mat.resize(new_rows, std::vector<T>(new_cols, initial));
-    rows = new_rows;
-    cols = new_cols;
-  }
-  if (new_cols != cols) {
+template<typename T, MatrixLayout Layout>
+void Matrix<T, Layout>::resize(const uint32_t new_rows, const uint32_t new_cols, const T initial) {
+  if (new_rows != rows || new_cols != cols) {
+    // Elements that fit in the new dimensions keep their values,
+    // everything else is set to `initial`.
+    Matrix<T, Layout> resized(new_rows, new_cols, initial);
+    uint32_t keep_rows = std::min(rows, new_rows);
+    uint32_t keep_cols = std::min(cols, new_cols);
 #pragma omp parallel for schedule(static)
-    for (uint32_t i = 0; i < new_rows; ++i) {
-      mat[i].resize(new_cols, initial);
+    for (uint32_t j = 0; j < keep_cols; ++j) {
+      for (uint32_t i = 0; i < keep_rows; ++i) {
+	resized(i, j) = (*this)(i, j);
+      }
     }
-    cols = new_cols;
+    this->swap(resized);
   }
 }
 
+// Reshape a matrix without keeping the values
+template<typename T, MatrixLayout Layout>
+void Matrix<T, Layout>::assign(const uint32_t new_rows, const uint32_t new_cols, const T initial) {
+  size_t n_elems = (size_t)new_rows*new_cols;
+  mat.resize(n_elems);
+#pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < n_elems; i++) {
+    mat[i] = initial;
+  }
+  rows = new_rows;
+  cols = new_cols;
+}
 
 // Assignment Operator
-template<typename T>
-Matrix<T>& Matrix<T>::operator=(const Matrix<T>& rhs) {
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout>& Matrix<T, Layout>::operator=(const Matrix<T, Layout>& rhs) {
   if (&rhs == this)
     return *this;
 
-  unsigned new_rows = rhs.get_rows();
-  unsigned new_cols = rhs.get_cols();
-  if (new_rows != rows || new_cols != cols) {
-    resize(new_rows, new_cols, (T)0);
-  }
-#pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < new_rows; i++) {
-    for (unsigned j = 0; j < new_cols; j++) {
-      mat[i][j] = rhs(i, j);
-    }
-  }
+  // Reuses the existing buffer if it is large enough.
+  mat = rhs.mat;
+  rows = rhs.get_rows();
+  cols = rhs.get_cols();
   return *this;
 }
 
-// Matrix-matrix addition
-template<typename T>
-Matrix<T> Matrix<T>::operator+(const Matrix<T>& rhs) const {
-  Matrix result(this->rows, this->cols, 0.0);
-
-#pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < this->rows; i++) {
-    for (unsigned j = 0; j < this->cols; j++) {
-      result(i, j) = this->mat[i][j] + rhs(i,j);
-    }
-  }
+// Exchange the contents of two matrices
+template<typename T, MatrixLayout Layout>
+void Matrix<T, Layout>::swap(Matrix<T, Layout>& rhs) {
+  std::swap(this->mat, rhs.mat);
+  std::swap(this->rows, rhs.rows);
+  std::swap(this->cols, rhs.cols);
+}
 
+// Matrix-matrix addition
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout> Matrix<T, Layout>::operator+(const Matrix<T, Layout>& rhs) const {
+  Matrix result(*this);
+  result += rhs;
   return result;
 }
 
 // In-place matrix-matrix addition
-template<typename T>
-Matrix<T>& Matrix<T>::operator+=(const Matrix<T>& rhs) {
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout>& Matrix<T, Layout>::operator+=(const Matrix<T, Layout>& rhs) {
+  size_t n_elems = this->mat.size();
 #pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < this->rows; i++) {
-    for (unsigned j = 0; j < this->cols; j++) {
-      this->mat[i][j] += rhs(i, j);
-    }
+  for (size_t i = 0; i < n_elems; i++) {
+    this->mat[i] += rhs.mat[i];
   }
 
   return *this;
 }
 
 // Fill matrix with sum of two matrices
-template <typename T>
-void Matrix<T>::sum_fill(const Matrix<T>& rhs1, const Matrix<T>& rhs2) {
+template<typename T, MatrixLayout Layout>
+void Matrix<T, Layout>::sum_fill(const Matrix<T, Layout>& rhs1, const Matrix<T, Layout>& rhs2) {
+  size_t n_elems = this->mat.size();
 #pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < this->rows; ++i) {
-    for (unsigned j = 0; j < this->cols; ++j) {
-      this->mat[i][j] = rhs1(i, j) + rhs2(i, j);
-    }
+  for (size_t i = 0; i < n_elems; ++i) {
+    this->mat[i] = rhs1.mat[i] + rhs2.mat[i];
   }
 }
 
 // Matrix-matrix subtraction
-template<typename T>
-Matrix<T> Matrix<T>::operator-(const Matrix<T>& rhs) const {
-  Matrix result(this->rows, this->cols, 0.0);
-
-#pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < this->rows; i++) {
-    for (unsigned j = 0; j < this->cols; j++) {
-      result(i, j) = this->mat[i][j] - rhs(i, j);
-    }
-  }
-
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout> Matrix<T, Layout>::operator-(const Matrix<T, Layout>& rhs) const {
+  Matrix result(*this);
+  result -= rhs;
   return result;
 }
 
 // In-place matrix-matrix subtraction
-template<typename T>
-Matrix<T>& Matrix<T>::operator-=(const Matrix<T>& rhs) {
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout>& Matrix<T, Layout>::operator-=(const Matrix<T, Layout>& rhs) {
+  size_t n_elems = this->mat.size();
 #pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < this->rows; i++) {
-    for (unsigned j = 0; j < this->cols; j++) {
-      this->mat[i][j] -= rhs(i, j);
-    }
+  for (size_t i = 0; i < n_elems; i++) {
+    this->mat[i] -= rhs.mat[i];
   }
 
   return *this;
 }
 
 // Matrix-matrix left multiplication
-template<typename T>
-Matrix<T> Matrix<T>::operator*(const Matrix<T>& rhs) const {
-  Matrix result(this->rows, this->cols, 0.0);
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout> Matrix<T, Layout>::operator*(const Matrix<T, Layout>& rhs) const {
+  Matrix result(this->rows, rhs.get_cols(), 0.0);
 
 #pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < this->rows; i++) {
-    for (unsigned j = 0; j < this->cols; j++) {
-      for (unsigned k = 0; k < this->rows; k++) {
-        result(i, j) += this->mat[i][k] * rhs(k, j);
+  for (unsigned j = 0; j < rhs.get_cols(); j++) {
+    for (unsigned k = 0; k < this->cols; k++) {
+      for (unsigned i = 0; i < this->rows; i++) {
+        result(i, j) += (*this)(i, k) * rhs(k, j);
       }
     }
   }
@@ -153,22 +156,22 @@ Matrix<T> Matrix<T>::operator*(const Matrix<T>& rhs) const {
 }
 
 // In-place matrix-matrix left multiplication
-template<typename T>
-Matrix<T>& Matrix<T>::operator*=(const Matrix<T>& rhs) {
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout>& Matrix<T, Layout>::operator*=(const Matrix<T, Layout>& rhs) {
   Matrix result = (*this) * rhs;
-  (*this) = result;
+  this->swap(result);
   return *this;
 }
 
 // Transpose matrix
-template<typename T>
-Matrix<T> Matrix<T>::transpose() const {
-  Matrix result(this->rows, this->cols, 0.0);
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout> Matrix<T, Layout>::transpose() const {
+  Matrix result(this->cols, this->rows, 0.0);
 
 #pragma omp parallel for schedule(static)
   for (unsigned i = 0; i < this->rows; i++) {
     for (unsigned j = 0; j < this->cols; j++) {
-      result(i, j) = this->mat[j][i];
+      result(j, i) = (*this)(i, j);
     }
   }
 
@@ -176,66 +179,62 @@ Matrix<T> Matrix<T>::transpose() const {
 }
 
 // In-place matrix-scalar addition
-template<typename T>
-Matrix<T>& Matrix<T>::operator+=(const T& rhs) {
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout>& Matrix<T, Layout>::operator+=(const T& rhs) {
+  size_t n_elems = this->mat.size();
 #pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < this->rows; i++) {
-    for (unsigned j = 0; j < this->cols; j++) {
-      this->mat[i][j] += rhs;
-    }
+  for (size_t i = 0; i < n_elems; i++) {
+    this->mat[i] += rhs;
   }
 
   return *this;
 }
 
 // In-place matrix-scalar subtraction
-template<typename T>
-Matrix<T>& Matrix<T>::operator-=(const T& rhs) {
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout>& Matrix<T, Layout>::operator-=(const T& rhs) {
+  size_t n_elems = this->mat.size();
 #pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < this->rows; i++) {
-    for (unsigned j=0; j < this->cols; j++) {
-      this->mat[i][j] -= rhs;
-    }
+  for (size_t i = 0; i < n_elems; i++) {
+    this->mat[i] -= rhs;
   }
 
   return *this;
 }
 
 // In-place matrix-scalar multiplication
-template<typename T>
-Matrix<T>& Matrix<T>::operator*=(const T& rhs) {
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout>& Matrix<T, Layout>::operator*=(const T& rhs) {
+  size_t n_elems = this->mat.size();
 #pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < this->rows; ++i) {
-    for (unsigned j = 0; j < this->cols; ++j) {
-      this->mat[i][j] *= rhs;
-    }
+  for (size_t i = 0; i < n_elems; ++i) {
+    this->mat[i] *= rhs;
   }
 
   return *this;
 }
 
 // In-place matrix-scalar division
-template<typename T>
-Matrix<T>& Matrix<T>::operator/=(const T& rhs) {
+template<typename T, MatrixLayout Layout>
+Matrix<T, Layout>& Matrix<T, Layout>::operator/=(const T& rhs) {
+  size_t n_elems = this->mat.size();
 #pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < this->rows; ++i) {
-    for (unsigned j = 0; j < this->cols; ++j) {
-      this->mat[i][j] /= rhs;
-    }
+  for (size_t i = 0; i < n_elems; ++i) {
+    this->mat[i] /= rhs;
   }
 
   return *this;
 }
 
 // Matrix-vector right multiplication
-template<typename T>
-std::vector<T> Matrix<T>::operator*(const std::vector<T>& rhs) const {
-  std::vector<T> result(rhs.size(), 0.0);
+template<typename T, MatrixLayout Layout>
+std::vector<T> Matrix<T, Layout>::operator*(const std::vector<T>& rhs) const {
+  std::vector<T> result(this->rows, 0.0);
 
 #pragma omp parallel for schedule(static)
   for (unsigned i = 0; i < rows; i++) {
     for (unsigned j = 0; j < cols; j++) {
-      result[i] += this->mat[i][j] * rhs[j];
+      result[i] += (*this)(i, j) * rhs[j];
     }
   }
 
@@ -243,100 +242,100 @@ std::vector<T> Matrix<T>::operator*(const std::vector<T>& rhs) const {
 }
 
 // Matrix-vector right multiplication, store result in arg
-template<typename T>
-void Matrix<T>::right_multiply(const std::vector<long unsigned>& rhs, std::vector<T>& result) const {
+template<typename T, MatrixLayout Layout>
+void Matrix<T, Layout>::right_multiply(const std::vector<long unsigned>& rhs, std::vector<T>& result) const {
 #pragma omp parallel for schedule(static)
   for (unsigned i = 0; i < this->rows; i++) {
     result[i] = 0.0;
     for (unsigned j = 0; j < this->cols; j++) {
-      result[i] += this->mat[i][j] * rhs[j];
+      result[i] += (*this)(i, j) * rhs[j];
     }
   }
 }
 
 // log-space Matrix-vector right multiplication, store result in arg
-template<typename T>
-void Matrix<T>::exp_right_multiply(const std::vector<T>& rhs, std::vector<T>& result) const {
+template<typename T, MatrixLayout Layout>
+void Matrix<T, Layout>::exp_right_multiply(const std::vector<T>& rhs, std::vector<T>& result) const {
   std::fill(result.begin(), result.end(), 0.0);
+  if (Layout == RowMajor) {
+#pragma omp parallel for schedule(static)
+    for (unsigned i = 0; i < this->rows; i++) {
+      const T* row = &this->mat[index(i, 0)];
+      for (unsigned j = 0; j < this->cols; j++) {
+	result[i] += std::exp(row[j] + rhs[j]);
+      }
+    }
+  } else {
+    // Walk the columns in storage order and reduce into the result.
 #pragma omp parallel for schedule(static) reduction(vec_double_plus:result)
-  for (unsigned i = 0; i < this->rows; i++) {
     for (unsigned j = 0; j < this->cols; j++) {
-      result[i] += std::exp(this->mat[i][j] + rhs[j]);
+      vmath::exp_add(&this->mat[index(0, j)], rhs[j], result.data(), this->rows);
     }
   }
 }
 
 // Specialized matrix-vector right multiplication
-template<typename T>
-std::vector<double> Matrix<T>::operator*(const std::vector<long unsigned>& rhs) const {
+template<typename T, MatrixLayout Layout>
+std::vector<double> Matrix<T, Layout>::operator*(const std::vector<long unsigned>& rhs) const {
   std::vector<double> result(this->rows, 0.0);
-  
+
 #pragma omp parallel for schedule(static)
   for (unsigned i = 0; i < this->rows; i++) {
     for (unsigned j = 0; j < this->cols; j++) {
-      result[i] += this->mat[i][j] * rhs[j];
+      result[i] += (*this)(i, j) * rhs[j];
     }
   }
 
   return result;
 }
 
-// Access individual elements
-template<typename T>
-T& Matrix<T>::operator()(unsigned row, unsigned col) {
-  return this->mat[row][col];
-}
-
-// Access individual elements (const)
-template<typename T>
-const T& Matrix<T>::operator()(unsigned row, unsigned col) const {
-  return this->mat[row][col];
-}
-
-// Access rows
-template<typename T>
-const std::vector<T>& Matrix<T>::get_row(unsigned row_id) const {
-  return this->mat[row_id];
-} 
-
-// Access cols
-template<typename T>
-const std::vector<T>& Matrix<T>::get_col(unsigned col_id) const {
-  std::vector<T> col(this->rows);
-#pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < this->rows; ++i) {
-    col[i] = this->mat[i][col_id];
-  }
-  return col;
-} 
-
 // LogSumExp a Matrix column
-template <typename T>
-T Matrix<T>::log_sum_exp_col(unsigned col_id) const {
-  // Note: this function accesses the elements rather inefficiently so
-  // it shouldn't be parallellised here. However, the caller can
-  // parallellize logsumexping multiple cols.
-  T max_elem = 0;
+template<typename T, MatrixLayout Layout>
+T Matrix<T, Layout>::log_sum_exp_col(unsigned col_id) const {
+  // The column is contiguous in the EC-major layout and strided in
+  // the group-major layout. The caller can parallellize logsumexping
+  // multiple cols.
+  const T* col = &this->mat[index(0, col_id)];
+  if (Layout == ColMajor) {
+    return vmath::log_sum_exp(col, this->rows);
+  }
+  const size_t stride = this->row_stride();
+  T max_elem = col[0];
   T sum = 0;
-  for (unsigned i = 0; i < this->rows; ++i) {
-    max_elem = (this->mat[i][col_id] > max_elem ? this->mat[i][col_id] : max_elem);
+  for (unsigned i = 1; i < this->rows; ++i) {
+    max_elem = (col[i*stride] > max_elem ? col[i*stride] : max_elem);
   }
 
   for (unsigned i = 0; i < this->rows; ++i) {
-    sum += std::exp(this->mat[i][col_id] - max_elem);
+    sum += std::exp(col[i*stride] - max_elem);
   }
   return max_elem + std::log(sum);
 }
 
+// Exponentiate a Matrix column into `result`
+template<typename T, MatrixLayout Layout>
+void Matrix<T, Layout>::exp_col(unsigned col_id, T* result) const {
+  const T* col = &this->mat[index(0, col_id)];
+  if (Layout == ColMajor) {
+    vmath::exp(col, result, this->rows);
+  } else {
+    const size_t stride = this->row_stride();
+    for (unsigned i = 0; i < this->rows; ++i) {
+      result[i] = col[i*stride];
+    }
+    vmath::exp(result, result, this->rows);
+  }
+}
+
 // Get the number of rows of the matrix
-template<typename T>
-unsigned Matrix<T>::get_rows() const {
+template<typename T, MatrixLayout Layout>
+unsigned Matrix<T, Layout>::get_rows() const {
   return this->rows;
 }
 
 // Get the number of columns of the matrix
-template<typename T>
-unsigned Matrix<T>::get_cols() const {
+template<typename T, MatrixLayout Layout>
+unsigned Matrix<T, Layout>::get_cols() const {
   return this->cols;
 }
 
@@ -0,0 +1,78 @@
+#include "output_format.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#include "openmp_config.hpp"
+
+// Target size of a block of formatted rows.
+static const size_t OUTPUT_BLOCK_BYTES = 1 << 20;
+// Number of blocks formatted in one batch per thread.
+static const size_t OUTPUT_BATCH_PER_THREAD = 2;
+
+void NumberFormat::append(const double x, std::string *buf) const {
+  // %g without a call to setlocale always uses '.' as the decimal
+  // point. Precision 6 matches the default std::ostream output.
+  char digits[32];
+  int len = 0;
+  if (this->precision > 0) {
+    len = std::snprintf(digits, sizeof(digits), "%.*g", (int)this->precision, x);
+  } else {
+    // 17 significant digits always read back exactly, most values
+    // need fewer.
+    for (int p = 15; p <= 17; ++p) {
+      len = std::snprintf(digits, sizeof(digits), "%.*g", p, x);
+      if (p == 17 || std::strtod(digits, nullptr) == x) {
+	break;
+      }
+    }
+  }
+  buf->append(digits, len);
+}
+
+void NumberFormat::append(const uint64_t x, std::string *buf) const {
+  char digits[20];
+  char *pos = digits + sizeof(digits);
+  uint64_t val = x;
+  do {
+    *--pos = '0' + (val % 10);
+    val /= 10;
+  } while (val > 0);
+  buf->append(pos, digits + sizeof(digits) - pos);
+}
+
+size_t RowsPerBlock(const size_t row_bytes) {
+  return std::max<size_t>(1, OUTPUT_BLOCK_BYTES/std::max<size_t>(1, row_bytes));
+}
+
+void WriteRows(const size_t n_rows, const size_t rows_per_block, const std::function<void(const size_t, const size_t, std::string*)> &format_rows, std::ostream &out) {
+  size_t n_blocks = (n_rows + rows_per_block - 1)/rows_per_block;
+  size_t batch_size = std::min<size_t>(n_blocks, OUTPUT_BATCH_PER_THREAD*omp_get_max_threads());
+  if (n_blocks == 1 || omp_get_max_threads() == 1) {
+    // Format and write one block at a time.
+    std::string buf;
+    for (size_t i = 0; i < n_blocks; ++i) {
+      buf.clear();
+      format_rows(i*rows_per_block, std::min(n_rows, (i + 1)*rows_per_block), &buf);
+      out.write(buf.data(), buf.size());
+    }
+    return;
+  }
+
+  // The buffers are kept between batches so that their memory is reused.
+  std::vector<std::string> blocks(batch_size);
+  for (size_t first_block = 0; first_block < n_blocks; first_block += batch_size) {
+    size_t n_in_batch = std::min(batch_size, n_blocks - first_block);
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < n_in_batch; ++i) {
+      size_t first_row = (first_block + i)*rows_per_block;
+      blocks[i].clear();
+      format_rows(first_row, std::min(n_rows, first_row + rows_per_block), &blocks[i]);
+    }
+    for (size_t i = 0; i < n_in_batch; ++i) {
+      out.write(blocks[i].data(), blocks[i].size());
+    }
+  }
+}
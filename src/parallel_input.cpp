@@ -0,0 +1,201 @@
+#include "parallel_input.hpp"
+
+#include <zlib.h>
+
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+
+#include "bxzstr.hpp"
+#include "block_queue.hpp"
+#include "openmp_config.hpp"
+
+// Size of the blocks read from inputs that are not BGZF.
+static const size_t READ_AHEAD_BLOCK_SIZE = 1 << 20;
+// Number of decompressed blocks that may wait for the reader.
+static const size_t READ_AHEAD_BLOCKS = 16;
+// Number of BGZF blocks inflated in one batch per thread.
+static const size_t BGZF_BATCH_PER_THREAD = 16;
+
+bool IsBGZF(std::istream &in) {
+  // gzip member with FEXTRA whose first extra subfield is 'BC'.
+  unsigned char header[14];
+  in.read(reinterpret_cast<char*>(header), 14);
+  bool bgzf = (in.gcount() == 14 && header[0] == 0x1f && header[1] == 0x8b && header[2] == 8 && (header[3] & 4) && header[12] == 'B' && header[13] == 'C');
+  in.clear();
+  in.seekg(0);
+  return bgzf;
+}
+
+bool ReadBGZFBlock(std::istream &in, std::string &block) {
+  // Header (18 bytes) with the total block size - 1 in BSIZE.
+  block.resize(18);
+  in.read(&block[0], 18);
+  if (in.gcount() == 0) {
+    return false;
+  }
+  const unsigned char* header = reinterpret_cast<const unsigned char*>(block.data());
+  if (in.gcount() != 18 || header[0] != 0x1f || header[1] != 0x8b || header[12] != 'B' || header[13] != 'C') {
+    throw std::runtime_error("Malformed BGZF block.");
+  }
+  size_t block_size = (header[16] | (header[17] << 8)) + 1;
+  block.resize(block_size);
+  in.read(&block[18], block_size - 18);
+  if ((size_t)in.gcount() != block_size - 18) {
+    throw std::runtime_error("Truncated BGZF block.");
+  }
+  return true;
+}
+
+void InflateBGZFBlock(const std::string &block, std::string *out) {
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(block.data());
+  size_t xlen = data[10] | (data[11] << 8);
+  size_t n = block.size();
+  if (n < 12 + xlen + 8) {
+    throw std::runtime_error("Corrupted BGZF block.");
+  }
+  uint32_t crc = data[n - 8] | (data[n - 7] << 8) | (data[n - 6] << 16) | ((uint32_t)data[n - 5] << 24);
+  uint32_t isize = data[n - 4] | (data[n - 3] << 8) | (data[n - 2] << 16) | ((uint32_t)data[n - 1] << 24);
+  // BGZF blocks hold at most 64 KiB of uncompressed data.
+  if (isize > 65536) {
+    throw std::runtime_error("Corrupted BGZF block.");
+  }
+  out->resize(isize);
+  if (isize > 0) {
+    z_stream strm = z_stream();
+    inflateInit2(&strm, -15);
+    strm.next_in = const_cast<Bytef*>(data + 12 + xlen);
+    strm.avail_in = n - 12 - xlen - 8;
+    strm.next_out = reinterpret_cast<Bytef*>(&(*out)[0]);
+    strm.avail_out = isize;
+    int status = inflate(&strm, Z_FINISH);
+    uLong total_out = strm.total_out;
+    inflateEnd(&strm);
+    if (status != Z_STREAM_END || total_out != isize) {
+      throw std::runtime_error("Corrupted BGZF block.");
+    }
+  }
+  if (crc32(0L, reinterpret_cast<const Bytef*>(out->data()), isize) != crc) {
+    throw std::runtime_error("Corrupted BGZF block.");
+  }
+}
+
+class ReadAheadBuf : public std::streambuf {
+private:
+  std::unique_ptr<std::istream> source;
+  BlockQueue queue{READ_AHEAD_BLOCKS};
+  std::string current;
+  std::exception_ptr error;
+  std::thread producer;
+
+  void read_blocks() {
+    while (*source) {
+      std::string block(READ_AHEAD_BLOCK_SIZE, '\0');
+      source->read(&block[0], block.size());
+      block.resize(source->gcount());
+      if (block.empty() || !queue.push(std::move(block))) {
+	break;
+      }
+    }
+  }
+
+  void inflate_blocks(const unsigned n_threads) {
+    std::vector<std::string> compressed(n_threads*BGZF_BATCH_PER_THREAD);
+    std::vector<std::string> inflated(compressed.size());
+    bool more = true;
+    while (more) {
+      size_t n_blocks = 0;
+      while (n_blocks < compressed.size() && (more = ReadBGZFBlock(*source, compressed[n_blocks]))) {
+	++n_blocks;
+      }
+      std::vector<std::exception_ptr> errors(n_blocks);
+#pragma omp parallel for num_threads(n_threads) schedule(static)
+      for (size_t i = 0; i < n_blocks; ++i) {
+	try {
+	  InflateBGZFBlock(compressed[i], &inflated[i]);
+	} catch (...) {
+	  errors[i] = std::current_exception();
+	}
+      }
+      for (size_t i = 0; i < n_blocks; ++i) {
+	if (errors[i]) {
+	  std::rethrow_exception(errors[i]);
+	}
+	if (!inflated[i].empty() && !queue.push(std::move(inflated[i]))) {
+	  return;
+	}
+      }
+    }
+  }
+
+protected:
+  int_type underflow() override {
+    while (gptr() == egptr()) {
+      if (!queue.pop(current)) {
+	if (error) {
+	  std::rethrow_exception(error);
+	}
+	return traits_type::eof();
+      }
+      setg(&current[0], &current[0], &current[0] + current.size());
+    }
+    return traits_type::to_int_type(*gptr());
+  }
+
+public:
+  ReadAheadBuf(std::unique_ptr<std::istream> &&source, const bool bgzf, const unsigned n_threads) : source(std::move(source)) {
+    producer = std::thread([this, bgzf, n_threads]() {
+      try {
+	if (bgzf) {
+	  inflate_blocks(n_threads);
+	} else {
+	  read_blocks();
+	}
+      } catch (...) {
+	error = std::current_exception();
+      }
+      queue.finish();
+    });
+  }
+  ~ReadAheadBuf() {
+    queue.cancel();
+    producer.join();
+  }
+};
+
+// Keeps the stream buffer alive for as long as the stream.
+class ReadAheadStream : public std::istream {
+private:
+  std::unique_ptr<ReadAheadBuf> buf;
+
+public:
+  ReadAheadStream(ReadAheadBuf *buf) : std::istream(buf), buf(buf) {
+    // Errors from the decompression are rethrown to the parser.
+    this->exceptions(std::ios::badbit);
+  }
+};
+
+std::unique_ptr<std::istream> OpenParallelInput(const std::string &path, const unsigned n_threads) {
+  bool bgzf = false;
+  std::unique_ptr<std::istream> source;
+  if (path == "-") {
+    source.reset(new bxz::istream(std::cin));
+  } else {
+    std::unique_ptr<std::ifstream> raw(new std::ifstream(path, std::ios::binary));
+    if (!raw->good()) {
+      throw std::runtime_error("Cannot read from file: " + path + ".");
+    }
+    bgzf = IsBGZF(*raw);
+    if (bgzf) {
+      source = std::move(raw);
+    } else {
+      raw.reset();
+      source.reset(new bxz::ifstream(path));
+    }
+  }
+  return std::unique_ptr<std::istream>(new ReadAheadStream(new ReadAheadBuf(std::move(source), bgzf, std::max(1u, n_threads))));
+}
@@ -0,0 +1,197 @@
+#include "parallel_output.hpp"
+
+#include <zlib.h>
+
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+
+#include "block_queue.hpp"
+#include "openmp_config.hpp"
+
+// Uncompressed size of a block; small enough that the compressed
+// block always fits in BGZF's 64 KiB limit.
+static const size_t BGZF_BLOCK_SIZE = 0xff00;
+// Number of full blocks that may wait for compression.
+static const size_t WRITE_BEHIND_BLOCKS = 64;
+// Number of blocks compressed in one batch per thread.
+static const size_t BGZF_BATCH_PER_THREAD = 4;
+
+void DeflateBGZFBlock(const std::string &block, std::string *out) {
+  z_stream strm = z_stream();
+  deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+  out->resize(18 + deflateBound(&strm, block.size()) + 8);
+  strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.data()));
+  strm.avail_in = block.size();
+  strm.next_out = reinterpret_cast<Bytef*>(&(*out)[18]);
+  strm.avail_out = out->size() - 18 - 8;
+  int status = deflate(&strm, Z_FINISH);
+  size_t compressed_size = strm.total_out;
+  deflateEnd(&strm);
+  if (status != Z_STREAM_END) {
+    throw std::runtime_error("Compressing the output failed.");
+  }
+
+  // gzip header with the BGZF extra field holding the block size - 1.
+  size_t block_size = 18 + compressed_size + 8;
+  unsigned char header[18] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+			       (unsigned char)((block_size - 1) & 0xff), (unsigned char)((block_size - 1) >> 8) };
+  std::copy(header, header + 18, out->begin());
+  uint32_t crc = crc32(0L, reinterpret_cast<const Bytef*>(block.data()), block.size());
+  uint32_t isize = block.size();
+  for (unsigned k = 0; k < 4; ++k) {
+    (*out)[18 + compressed_size + k] = (crc >> (8*k)) & 0xff;
+    (*out)[18 + compressed_size + 4 + k] = (isize >> (8*k)) & 0xff;
+  }
+  out->resize(block_size);
+}
+
+class WriteBehindBuf : public std::streambuf {
+private:
+  std::ofstream sink;
+  BlockQueue queue{WRITE_BEHIND_BLOCKS};
+  std::string current;
+  std::exception_ptr error;
+  std::atomic<bool> failed{false};
+  bool closed = false;
+  std::thread consumer;
+
+  void compress_blocks(const unsigned n_threads) {
+    std::vector<std::string> blocks(n_threads*BGZF_BATCH_PER_THREAD);
+    std::vector<std::string> compressed(blocks.size());
+    bool more = true;
+    while (more) {
+      size_t n_blocks = 0;
+      while (n_blocks < blocks.size() && (more = queue.pop(blocks[n_blocks]))) {
+	++n_blocks;
+      }
+      std::vector<std::exception_ptr> errors(n_blocks);
+#pragma omp parallel for num_threads(n_threads) schedule(static)
+      for (size_t i = 0; i < n_blocks; ++i) {
+	try {
+	  DeflateBGZFBlock(blocks[i], &compressed[i]);
+	} catch (...) {
+	  errors[i] = std::current_exception();
+	}
+      }
+      for (size_t i = 0; i < n_blocks; ++i) {
+	if (errors[i]) {
+	  std::rethrow_exception(errors[i]);
+	}
+	sink.write(compressed[i].data(), compressed[i].size());
+      }
+    }
+    // End-of-file marker: an empty block.
+    std::string eof;
+    DeflateBGZFBlock(std::string(), &eof);
+    sink.write(eof.data(), eof.size());
+    sink.flush();
+    if (!sink.good()) {
+      throw std::runtime_error("Writing the compressed output failed.");
+    }
+  }
+
+  // Returns false if the block could not be queued because the
+  // compression has failed.
+  bool push_current() {
+    current.resize(pptr() - pbase());
+    bool queued = (current.empty() || queue.push(std::move(current)));
+    current.assign(BGZF_BLOCK_SIZE, '\0');
+    setp(&current[0], &current[0] + current.size());
+    return queued;
+  }
+
+protected:
+  // A failure sets badbit on the stream through the eof return value.
+  int_type overflow(int_type c) override {
+    if (closed || failed || !push_current()) {
+      return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+  int sync() override {
+    return (failed ? -1 : 0);
+  }
+
+public:
+  WriteBehindBuf(const std::string &path, const unsigned n_threads) : sink(path, std::ios::binary) {
+    if (!sink.good()) {
+      throw std::runtime_error("File " + path + " is not writable (does the directory exist?).");
+    }
+    current.assign(BGZF_BLOCK_SIZE, '\0');
+    setp(&current[0], &current[0] + current.size());
+    consumer = std::thread([this, n_threads]() {
+      try {
+	compress_blocks(n_threads);
+      } catch (...) {
+	error = std::current_exception();
+	failed = true;
+	queue.cancel();
+      }
+    });
+  }
+  ~WriteBehindBuf() {
+    try {
+      close();
+    } catch (std::exception &e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+
+  // Writes the remaining blocks and the end-of-file marker, and
+  // rethrows the error if compressing or writing failed.
+  void close() {
+    if (closed) {
+      return;
+    }
+    closed = true;
+    push_current();
+    queue.finish();
+    consumer.join();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+};
+
+// Keeps the stream buffer alive for as long as the stream.
+class WriteBehindStream : public std::ostream {
+private:
+  std::unique_ptr<WriteBehindBuf> buf;
+
+public:
+  WriteBehindStream(WriteBehindBuf *buf) : std::ostream(buf), buf(buf) {}
+
+  void close() {
+    try {
+      buf->close();
+    } catch (...) {
+      setstate(std::ios::badbit);
+      throw;
+    }
+  }
+};
+
+std::unique_ptr<std::ostream> OpenParallelGzipOutput(const std::string &path, const unsigned n_threads) {
+  return std::unique_ptr<std::ostream>(new WriteBehindStream(new WriteBehindBuf(path, std::max(1u, n_threads))));
+}
+
+void CloseOutput(std::ostream &of, const std::string &path) {
+  WriteBehindStream* gz = dynamic_cast<WriteBehindStream*>(&of);
+  if (gz != nullptr) {
+    gz->close();
+  }
+  of.flush();
+  if (!of.good()) {
+    throw std::runtime_error("Writing to " + path + " failed.");
+  }
+}
@@ -19,9 +19,17 @@ void PrintHelpMessage() {
 	    << "\tPseudoalignment output file location from kallisto. Can't be used when -b is specified.\n"
     	    << "\t-b <pseudomappingBatch>\n"
 	    << "\tThe kallisto batch matrix file location. Can't be used when -f is specified.\n"
+    	    << "\t--read-cache <cacheFile>\n"
+	    << "\tRead the pseudoalignments from a cache written with --write-cache.\n"
+    	    << "\t--manifest <sampleList>\n"
+	    << "\tEstimate many samples in one run, one per line as <name> followed by tab-separated Themisto pair, kallisto folder or cache.\n"
+    	    << "\t--write-cache <cacheFile>\n"
+	    << "\tWrite the pseudoalignments to a binary cache for faster reruns (optional).\n"
 	    << "\n"
 	    << "\t-i <clusterIndicators>\n"
 	    << "\tGroup identifiers file. Must be supplied.\n"
+	    << "\t--reference-index <referenceIndex>\n"
+	    << "\tRead the grouping from an index written with 'mSWEEP index' instead of -i.\n"
 	    << "\t-o <outputFile>\n"
 	    << "\tOutput file (folder when estimating from a batch) to write results in.\n"
     	    << "\t-t <nrThreads>\n"
@@ -31,6 +39,8 @@ void PrintHelpMessage() {
 	    << "\tHow to merge Themisto pseudoalignments for paired-end reads	(default: intersection).\n"
     	    << "\t--themisto-index <ThemistoIndex>\n"
 	    << "\tPath to the Themisto index the pseudoalignment was performed against (optional).\n"
+    	    << "\t--themisto-stream\n"
+	    << "\tRead the Themisto pseudoalignments one read at a time (accepts named pipes and - for stdin).\n"
 	    << "\n"
     	    << "\t--fasta <ReferenceSequences>\n"
 	    << "\tPath to the reference sequences the pseudoalignment index was constructed from (optional)\n"
@@ -52,13 +62,54 @@ void PrintHelpMessage() {
             << "\tPrint the equivalence class probabilities rather than writing when using --write-probs\n"    
             << "\t--gzip-probs\n"
             << "\tGzip the .csv matrix output from --write-probs\n"
+            << "\t--probs-top-k <nrGroups>\n"
+            << "\tWrite only the k most probable groups of each equivalence class as ec_id,group,probability rows\n"
+            << "\t--probs-min <minProbability>\n"
+            << "\tWrite only the probabilities at least this large as ec_id,group,probability rows\n"
+            << "\t--precision <digits>\n"
+            << "\tSignificant digits in the written probabilities and abundances, 0 writes values that read back exactly (default: 6)\n"
 	    << "\t--help\n"
 	    << "\tPrint this message.\n"
 	    << "\n\tELBO optimization and modeling (these seldom need to be changed)\n"
 	    << "\t--tol <tolerance>\n"
-	    << "\tOptimization has converged when the bound changes less than the given tolerance.\n"
+	    << "\tOptimization has converged when the convergence criterion is less than the given tolerance.\n"
+	    << "\t--convergence <bound|gradient|abundances>\n"
+	    << "\tCriterion compared to --tol: change in the bound, norm of the gradient (rcg only), or largest\n"
+	    << "\tchange in a relative abundance in one iteration. (default: bound)\n"
+	    << "\t--active-set <minReads>\n"
+	    << "\tAfter a burn-in, optimize only the groups with at least this many expected reads; the others are\n"
+	    << "\tre-checked when the optimization has converged. All steps share --max-iters. (default: 0 = all groups)\n"
 	    << "\t--max-iters\n"
 	    << "\tMaximum number of iterations to run the gradient optimizer.\n"
+	    << "\t--optimizer <rcg|squarem|low-memory>\n"
+	    << "\tConjugate gradient (rcg), SQUAREM-accelerated fixed point iteration (squarem), or squarem without\n"
+	    << "\tstoring the read-reference probabilities (low-memory, recomputes them for output). (default: rcg)\n"
+	    << "\t--single-precision\n"
+	    << "\tStore the read-reference probabilities in single precision (halves their memory use).\n"
+	    << "\t-q <meanFraction>\n"
+	    << "\tFraction of the sequences in a group that the mean is set to."
+	    << " (default: 0.65)\n"
+	    << "\t-e <dispersionTerm>\n"
+	    << "\tCalibration term in the likelihood function."
+	    << " (default: 0.01)" << std::endl;
+}
+
+void PrintIndexHelpMessage() {
+  std::cerr << "Usage: mSWEEP index -i <clusterIndicators> -o <referenceIndex> [OPTIONS]\n"
+	    << "Writes the grouping to a binary index for use with --reference-index.\n\n"
+	    << "Options:\n"
+	    << "\t-i <clusterIndicators>\n"
+	    << "\tGroup identifiers file.\n"
+    	    << "\t--fasta <ReferenceSequences>\n"
+	    << "\tPath to the reference sequences (use with --groups-list instead of -i)\n"
+    	    << "\t--groups-list <groupIndicatorsList>\n"
+	    << "\tTable containing names of the reference sequences (1st column) and their group assignments (2nd column)\n"
+    	    << "\t--groups-delimiter <groupIndicatorsListDelimiter>\n"
+	    << "\tDelimiter character for the --groups option (optional, default: tab)\n"
+	    << "\t-o <referenceIndex>\n"
+	    << "\tFile to write the index to. Must be supplied.\n"
+	    << "\t--write-lls\n"
+	    << "\tAlso store the log-likelihood table (larger index, faster start).\n"
 	    << "\t-q <meanFraction>\n"
 	    << "\tFraction of the sequences in a group that the mean is set to."
 	    << " (default: 0.65)\n"
@@ -96,7 +147,72 @@ double ParseDoubleOption(char **begin, char **end, const std::string &option) {
   return(opt);
 }
 
+void ParseGroupingArguments(int argc, char *argv[], Arguments &args) {
+  if (CmdOptionPresent(argv, argv+argc, "-i")) {
+    args.indicators_file = std::string(GetCmdOption(argv, argv+argc, "-i"));
+  } else if (CmdOptionPresent(argv, argv+argc, "--indicators")) {
+    args.indicators_file = std::string(GetCmdOption(argv, argv+argc, "--indicators"));
+  } else if (!CmdOptionPresent(argv, argv+argc, "--fasta") || !CmdOptionPresent(argv, argv+argc, "--groups-list")) {
+    throw std::runtime_error("group indicator file not found.");
+  }
+
+  if (CmdOptionPresent(argv, argv+argc, "--fasta") || CmdOptionPresent(argv, argv+argc, "--groups-list") || CmdOptionPresent(argv, argv+argc, "--groups-delimiter")) {
+    if ((!CmdOptionPresent(argv, argv+argc, "--fasta") || !CmdOptionPresent(argv, argv+argc, "--groups-list"))) {
+      throw std::runtime_error("--fasta and --groups-list must both be specified if either is present.");
+    }
+    args.fasta_file = std::string(GetCmdOption(argv, argv+argc, "--fasta"));
+    args.groups_list_file = std::string(GetCmdOption(argv, argv+argc, "--groups-list"));
+    if (CmdOptionPresent(argv, argv+argc, "--groups-delimiter")) {
+      std::string groups_list_delimiter = std::string(GetCmdOption(argv, argv+argc, "--groups-delimiter"));
+      if (groups_list_delimiter.size() > 1) {
+	throw std::runtime_error("--groups-delimiter must be a single character");
+      } else {
+	args.groups_list_delimiter = groups_list_delimiter.at(0);
+      }
+    }
+  }
+}
+
+void ParseModelArguments(int argc, char *argv[], Arguments &args) {
+  if (CmdOptionPresent(argv, argv+argc, "-q")) {
+    double frac_mu = ParseDoubleOption(argv, argv+argc, "-q");
+    if (frac_mu <= 0.5 || frac_mu >= 1.0) {
+      throw std::runtime_error("-q must be between 0.5 and 1.");
+    } else {
+      args.params[0] = frac_mu;
+    }
+  }
+  
+  if (CmdOptionPresent(argv, argv+argc, "-e")) {
+    double epsilon = ParseDoubleOption(argv, argv+argc, "-e");
+    if (epsilon <= 0.0 || epsilon >= 2.0*(args.params[0]) - 1.0) {
+      throw std::runtime_error("-e must be greater than 0, and less than 2*q - 1");
+    } else {
+      args.params[1] = epsilon;
+    }
+  }
+}
+
+void ParseIndexArguments(int argc, char *argv[], Arguments &args) {
+  args.index_mode = true;
+  ParseGroupingArguments(argc, argv, args);
+  if (CmdOptionPresent(argv, argv+argc, "-o")) {
+    args.outfile = std::string(GetCmdOption(argv, argv+argc, "-o"));
+  } else {
+    throw std::runtime_error("-o must be specified with mSWEEP index.");
+  }
+  args.index_lls = CmdOptionPresent(argv, argv+argc, "--write-lls");
+  ParseModelArguments(argc, argv, args);
+}
+
 void ParseArguments(int argc, char *argv[], Arguments &args) {
+  if (argc > 1 && std::string(argv[1]) == "index") {
+    if (CmdOptionPresent(argv, argv+argc, "--help")) {
+      throw std::invalid_argument("index");
+    }
+    ParseIndexArguments(argc, argv, args);
+    return;
+  }
   if (CmdOptionPresent(argv, argv+argc, "--help")) {
     throw std::invalid_argument("");
   }
@@ -108,6 +224,31 @@ void ParseArguments(int argc, char *argv[], Arguments &args) {
   args.optimizer.write_probs = CmdOptionPresent(argv, argv+argc, "--write-probs");
   args.optimizer.gzip_probs = CmdOptionPresent(argv, argv+argc, "--gzip-probs");
   args.optimizer.print_probs = CmdOptionPresent(argv, argv+argc, "--print-probs");
+  if (CmdOptionPresent(argv, argv+argc, "--probs-top-k")) {
+    signed top_k = std::stoi(std::string(GetCmdOption(argv, argv+argc, "--probs-top-k")));
+    if (top_k < 1) {
+      throw std::runtime_error("--probs-top-k must be at least 1");
+    } else {
+      args.optimizer.probs_top_k = top_k;
+    }
+  }
+  if (CmdOptionPresent(argv, argv+argc, "--probs-min")) {
+    double probs_min = ParseDoubleOption(argv, argv+argc, "--probs-min");
+    if (probs_min <= 0.0 || probs_min > 1.0) {
+      throw std::runtime_error("--probs-min must be greater than 0 and at most 1");
+    } else {
+      args.optimizer.probs_min = probs_min;
+    }
+  }
+  if (CmdOptionPresent(argv, argv+argc, "--precision")) {
+    signed precision = std::stoi(std::string(GetCmdOption(argv, argv+argc, "--precision")));
+    if (precision < 0 || precision > 17) {
+      throw std::runtime_error("--precision must be between 0 and 17");
+    } else {
+      args.optimizer.precision = precision;
+    }
+  }
+  args.optimizer.single_precision = CmdOptionPresent(argv, argv+argc, "--single-precision");
   
   if ((CmdOptionPresent(argv, argv+argc, "-f") || CmdOptionPresent(argv, argv+argc, "--file"))  && CmdOptionPresent(argv, argv+argc, "-b")) {
     throw std::runtime_error("infile and batchfile found, specify only one");
@@ -131,20 +272,56 @@ void ParseArguments(int argc, char *argv[], Arguments &args) {
       args.themisto_index_path = std::string(GetCmdOption(argv, argv+argc, "--themisto-index"));
       CheckDirExists(args.themisto_index_path);
     }
+    args.themisto_stream = CmdOptionPresent(argv, argv+argc, "--themisto-stream");
+    if (args.tinfile1 == "-" && args.tinfile2 == "-") {
+      throw std::runtime_error("only one of --themisto-1 and --themisto-2 can be read from stdin.");
+    } else if ((args.tinfile1 == "-" || args.tinfile2 == "-") && !args.themisto_stream) {
+      throw std::runtime_error("reading Themisto pseudoalignments from stdin requires --themisto-stream.");
+    }
+  } else if (CmdOptionPresent(argv, argv+argc, "--read-cache")) {
+    args.cache_infile = std::string(GetCmdOption(argv, argv+argc, "--read-cache"));
+  } else if (CmdOptionPresent(argv, argv+argc, "--manifest")) {
+    args.manifest_file = std::string(GetCmdOption(argv, argv+argc, "--manifest"));
+    if (CmdOptionPresent(argv, argv+argc, "--themisto-mode")) {
+      args.themisto_merge_mode = std::string(GetCmdOption(argv, argv+argc, "--themisto-mode"));
+    } else {
+      args.themisto_merge_mode = std::string("intersection");
+    }
+    args.themisto_stream = CmdOptionPresent(argv, argv+argc, "--themisto-stream");
+    if (CmdOptionPresent(argv, argv+argc, "--iters") || CmdOptionPresent(argv, argv+argc, "--write-cache")) {
+      throw std::runtime_error("--manifest can't be used with --iters or --write-cache.");
+    }
   } else {
     throw std::runtime_error("infile not found.");
   }
+  if (CmdOptionPresent(argv, argv+argc, "--write-cache")) {
+    if (args.batch_mode) {
+      throw std::runtime_error("--write-cache can't be used with a kallisto batch.");
+    }
+    args.cache_outfile = std::string(GetCmdOption(argv, argv+argc, "--write-cache"));
+  }
+
+  if (CmdOptionPresent(argv, argv+argc, "-t")) {
+    signed nr_threads_given = std::stoi(std::string(GetCmdOption(argv, argv+argc, "-t")));
+    if (nr_threads_given < 1) {
+      throw std::runtime_error("number of threads must be strictly positive");
+    } else {
+      args.optimizer.nr_threads = nr_threads_given;
+    }
+  } else {
+    args.optimizer.nr_threads = 1;
+  }
 
   // Fill the kallisto_files vector
   args.kallisto_files = std::vector<std::string>((args.batch_mode ? 4 : 3));
   if (args.batch_mode) {
-    args.infiles = KallistoFiles(args.batch_infile, args.batch_mode);
+    args.infiles = KallistoFiles(args.batch_infile, args.batch_mode, args.optimizer.nr_threads);
     args.kallisto_files[0] = args.batch_infile + "/run_info.json";
     args.kallisto_files[1] = args.batch_infile + "/matrix.ec";
     args.kallisto_files[2] = args.batch_infile + "/matrix.tsv";
     args.kallisto_files[3] = args.batch_infile + "/matrix.cells";
-  } else if (!args.themisto_mode) {
-    args.infiles = KallistoFiles(args.infile, args.batch_mode);
+  } else if (!args.themisto_mode && args.cache_infile.empty() && args.manifest_file.empty()) {
+    args.infiles = KallistoFiles(args.infile, args.batch_mode, args.optimizer.nr_threads);
     args.kallisto_files[0] = args.infile + "/run_info.json";
     args.kallisto_files[1] = args.infile + "/pseudoalignments.ec";
     args.kallisto_files[2] = args.infile + "/pseudoalignments.tsv";
@@ -155,12 +332,10 @@ void ParseArguments(int argc, char *argv[], Arguments &args) {
     }
   }
 
-  if (CmdOptionPresent(argv, argv+argc, "-i")) {
-    args.indicators_file = std::string(GetCmdOption(argv, argv+argc, "-i"));
-  } else if (CmdOptionPresent(argv, argv+argc, "--indicators")) {
-    args.indicators_file = std::string(GetCmdOption(argv, argv+argc, "--indicators"));
-  } else if (!CmdOptionPresent(argv, argv+argc, "--fasta") || !CmdOptionPresent(argv, argv+argc, "--groups-list")) {
-    throw std::runtime_error("group indicator file not found.");
+  if (CmdOptionPresent(argv, argv+argc, "--reference-index")) {
+    args.reference_index = std::string(GetCmdOption(argv, argv+argc, "--reference-index"));
+  } else {
+    ParseGroupingArguments(argc, argv, args);
   }
 
   if (CmdOptionPresent(argv, argv+argc, "-o")) {
@@ -191,22 +366,6 @@ void ParseArguments(int argc, char *argv[], Arguments &args) {
     }
   }
 
-  if (CmdOptionPresent(argv, argv+argc, "--fasta") || CmdOptionPresent(argv, argv+argc, "--groups-list") || CmdOptionPresent(argv, argv+argc, "--groups-delimiter")) {
-    if ((!CmdOptionPresent(argv, argv+argc, "--fasta") || !CmdOptionPresent(argv, argv+argc, "--groups-list"))) {
-      throw std::runtime_error("--fasta and --groups-list must both be specified if either is present.");
-    }
-    args.fasta_file = std::string(GetCmdOption(argv, argv+argc, "--fasta"));
-    args.groups_list_file = std::string(GetCmdOption(argv, argv+argc, "--groups-list"));
-    if (CmdOptionPresent(argv, argv+argc, "--groups-delimiter")) {
-      std::string groups_list_delimiter = std::string(GetCmdOption(argv, argv+argc, "--groups-delimiter"));
-      if (groups_list_delimiter.size() > 1) {
-	throw std::runtime_error("--groups-delimiter must be a single character");
-      } else {
-	args.groups_list_delimiter = groups_list_delimiter.at(0);
-      }
-    }
-  }
-
   if (CmdOptionPresent(argv, argv+argc, "--bootstrap-count")) {
     signed bootstrap_count_given = std::stoi(std::string(GetCmdOption(argv, argv+argc, "--bootstrap-count")));
     if (bootstrap_count_given < 1) {
@@ -216,17 +375,6 @@ void ParseArguments(int argc, char *argv[], Arguments &args) {
     }
   }
 
-  if (CmdOptionPresent(argv, argv+argc, "-t")) {
-    signed nr_threads_given = std::stoi(std::string(GetCmdOption(argv, argv+argc, "-t")));
-    if (nr_threads_given < 1) {
-      throw std::runtime_error("number of threads must be strictly positive");
-    } else {
-      args.optimizer.nr_threads = nr_threads_given;
-    }
-  } else {
-    args.optimizer.nr_threads = 1;
-  }
-
   if (CmdOptionPresent(argv, argv+argc, "--tol")) {
     double tolerance = ParseDoubleOption(argv, argv+argc, "--tol");
     if (tolerance <= 0) {
@@ -245,21 +393,31 @@ void ParseArguments(int argc, char *argv[], Arguments &args) {
     }
   }
 
-  if (CmdOptionPresent(argv, argv+argc, "-q")) {
-    double frac_mu = ParseDoubleOption(argv, argv+argc, "-q");
-    if (frac_mu <= 0.5 || frac_mu >= 1.0) {
-      throw std::runtime_error("-q must be between 0.5 and 1.");
-    } else {
-      args.params[0] = frac_mu;
+  if (CmdOptionPresent(argv, argv+argc, "--optimizer")) {
+    args.optimizer.method = std::string(GetCmdOption(argv, argv+argc, "--optimizer"));
+    if (args.optimizer.method != "rcg" && args.optimizer.method != "squarem" && args.optimizer.method != "low-memory") {
+      throw std::runtime_error("--optimizer must be rcg, squarem or low-memory");
     }
   }
-  
-  if (CmdOptionPresent(argv, argv+argc, "-e")) {
-    double epsilon = ParseDoubleOption(argv, argv+argc, "-e");
-    if (epsilon <= 0.0 || epsilon >= 2.0*(args.params[0]) - 1.0) {
-      throw std::runtime_error("-e must be greater than 0, and less than 2*q - 1");
+
+  if (CmdOptionPresent(argv, argv+argc, "--convergence")) {
+    args.optimizer.convergence = std::string(GetCmdOption(argv, argv+argc, "--convergence"));
+    if (args.optimizer.convergence != "bound" && args.optimizer.convergence != "gradient" && args.optimizer.convergence != "abundances") {
+      throw std::runtime_error("--convergence must be bound, gradient or abundances");
+    }
+    if (args.optimizer.convergence == "gradient" && args.optimizer.method != "rcg") {
+      throw std::runtime_error("--convergence gradient requires --optimizer rcg");
+    }
+  }
+
+  if (CmdOptionPresent(argv, argv+argc, "--active-set")) {
+    double active_set = ParseDoubleOption(argv, argv+argc, "--active-set");
+    if (active_set < 0) {
+      throw std::runtime_error("--active-set can't be negative");
     } else {
-      args.params[1] = epsilon;
+      args.optimizer.active_set = active_set;
     }
   }
+
+  ParseModelArguments(argc, argv, args);
 }
@@ -0,0 +1,219 @@
+#include "posterior.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+#include "openmp_config.hpp"
+#include "vmath.hpp"
+
+void PosteriorSums::prepare(const unsigned n_chunks, const unsigned n_rows) {
+  this->hit_sums.assign((size_t)n_chunks*n_rows, 0.0);
+  this->hit_missed.assign((size_t)n_chunks*n_rows, 0.0);
+  this->missed.assign(n_chunks, 0.0);
+  this->norms.assign(n_chunks, 0.0);
+  this->thread_cols.resize((size_t)omp_get_max_threads()*(n_rows + 1));
+}
+
+double* PosteriorSums::thread_col(const unsigned n_rows) {
+  return &this->thread_cols[(size_t)omp_get_thread_num()*(n_rows + 1)];
+}
+
+size_t PosteriorSums::size_in_bytes() const {
+  size_t n_values = this->hit_sums.capacity() + this->hit_missed.capacity() + this->missed.capacity();
+  n_values += this->norms.capacity() + this->thread_cols.capacity();
+  return n_values*sizeof(double);
+}
+
+template <typename T>
+void SparsePosterior<T>::assign(const SparseMatrix<uint16_t> &counts, const double initial) {
+  this->counts = &counts;
+  this->hits.assign(counts.nnz(), initial);
+  this->group_term.assign(counts.get_rows(), 0.0);
+  this->ec_term.assign(counts.get_cols(), initial);
+}
+
+template <typename T>
+double SparsePosterior<T>::operator()(const unsigned row, const unsigned col) const {
+  size_t pos = this->counts->find(row, col);
+  return (pos < this->counts->col_end(col) ? this->hits[pos] : this->group_term[row] + this->ec_term[col]);
+}
+
+template <typename T>
+void SparsePosterior<T>::fill_col(const unsigned col, double *result) const {
+  unsigned n_rows = this->get_rows();
+  for (unsigned i = 0; i < n_rows; ++i) {
+    result[i] = this->group_term[i] + this->ec_term[col];
+  }
+  for (size_t k = this->counts->col_start(col); k < this->counts->col_end(col); ++k) {
+    result[this->counts->row_id(k)] = this->hits[k];
+  }
+}
+
+template <typename T>
+void SparsePosterior<T>::exp_right_multiply(const std::vector<double> &rhs, std::vector<double> &result, PosteriorSums &sums) const {
+  // The groups missed by column j contribute exp(group_term[i]) *
+  // exp(ec_term[j] + rhs[j]). Their sum over the columns is taken
+  // over all columns and the columns that hit group i are subtracted.
+  // The columns are split in a fixed number of chunks that are summed
+  // in order so that the result doesn't depend on the number of threads.
+  unsigned n_rows = this->get_rows();
+  unsigned n_cols = this->get_cols();
+  unsigned n_chunks = std::min(n_cols, 64u);
+  sums.prepare(n_chunks, n_rows);
+  std::vector<double> &hit_sums = sums.hit_sums;
+  std::vector<double> &hit_missed = sums.hit_missed;
+  std::vector<double> &missed = sums.missed;
+
+#pragma omp parallel for schedule(static)
+  for (unsigned c = 0; c < n_chunks; ++c) {
+    double* chunk_hits = &hit_sums[(size_t)c*n_rows];
+    double* chunk_missed = &hit_missed[(size_t)c*n_rows];
+    unsigned chunk_end = (uint64_t)(c + 1)*n_cols/n_chunks;
+    for (unsigned j = (uint64_t)c*n_cols/n_chunks; j < chunk_end; ++j) {
+      double ec_missed = std::exp(this->ec_term[j] + rhs[j]);
+      missed[c] += ec_missed;
+      for (size_t k = this->counts->col_start(j); k < this->counts->col_end(j); ++k) {
+	chunk_hits[this->counts->row_id(k)] += std::exp(this->hits[k] + rhs[j]);
+	chunk_missed[this->counts->row_id(k)] += ec_missed;
+      }
+    }
+  }
+
+  double missed_total = 0.0;
+  for (unsigned c = 0; c < n_chunks; ++c) {
+    missed_total += missed[c];
+  }
+#pragma omp parallel for schedule(static)
+  for (unsigned i = 0; i < n_rows; ++i) {
+    double hits_i = 0.0;
+    double missed_i = missed_total;
+    for (unsigned c = 0; c < n_chunks; ++c) {
+      hits_i += hit_sums[(size_t)c*n_rows + i];
+      missed_i -= hit_missed[(size_t)c*n_rows + i];
+    }
+    result[i] = hits_i + std::exp(this->group_term[i])*std::max(missed_i, 0.0);
+  }
+}
+
+template class SparsePosterior<float>;
+template class SparsePosterior<double>;
+
+void FixedPointPosterior::assign(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &digamma_N_k) {
+  this->logl = &logl;
+  this->counts = &counts;
+  this->digamma_N_k = digamma_N_k;
+  unsigned n_rows = counts.get_rows();
+  this->group_term.resize(n_rows);
+  this->group_weight.resize(n_rows);
+  this->shift = -std::numeric_limits<double>::infinity();
+  for (unsigned i = 0; i < n_rows; ++i) {
+    this->group_term[i] = logl(i, 0) + digamma_N_k[i];
+    this->shift = std::max(this->shift, this->group_term[i]);
+  }
+  this->weight_total = 0.0;
+  for (unsigned i = 0; i < n_rows; ++i) {
+    this->group_term[i] -= this->shift;
+    this->group_weight[i] = std::exp(this->group_term[i]);
+    this->weight_total += this->group_weight[i];
+  }
+}
+
+double FixedPointPosterior::col_terms(const unsigned col, double *hits_col) const {
+  size_t hits_start = this->counts->col_start(col);
+  size_t hits_end = this->counts->col_end(col);
+  unsigned n_hits = hits_end - hits_start;
+  for (size_t k = hits_start; k < hits_end; ++k) {
+    uint32_t i = this->counts->row_id(k);
+    hits_col[k - hits_start] = (*this->logl)(i, this->counts->value(k)) + this->digamma_N_k[i] - this->shift;
+  }
+  double missed;
+  missed_sums<1>(*this->counts, col, this->group_weight.data(), &this->weight_total, &missed);
+  unsigned n_terms = n_hits;
+  if (missed > 0.0) {
+    hits_col[n_terms++] = std::log(missed);
+  }
+  return vmath::log_sum_exp(hits_col, n_terms);
+}
+
+double FixedPointPosterior::expected_counts(const std::vector<double> &rhs, std::vector<double> &result, PosteriorSums &sums) const {
+  // Same order of summation as SparsePosterior::exp_right_multiply.
+  unsigned n_rows = this->get_rows();
+  unsigned n_cols = this->get_cols();
+  unsigned n_chunks = std::min(n_cols, 64u);
+  sums.prepare(n_chunks, n_rows);
+  std::vector<double> &hit_sums = sums.hit_sums;
+  std::vector<double> &hit_missed = sums.hit_missed;
+  std::vector<double> &missed = sums.missed;
+  std::vector<double> &norms = sums.norms;
+
+#pragma omp parallel
+  {
+    double* hits_col = sums.thread_col(n_rows);
+#pragma omp for schedule(static)
+    for (unsigned c = 0; c < n_chunks; ++c) {
+      double* chunk_hits = &hit_sums[(size_t)c*n_rows];
+      double* chunk_missed = &hit_missed[(size_t)c*n_rows];
+      unsigned chunk_end = (uint64_t)(c + 1)*n_cols/n_chunks;
+      for (unsigned j = (uint64_t)c*n_cols/n_chunks; j < chunk_end; ++j) {
+	double m = this->col_terms(j, hits_col);
+	double ec_missed = std::exp(rhs[j] - m);
+	missed[c] += ec_missed;
+	norms[c] += std::exp(rhs[j])*(m + this->shift);
+	size_t hits_start = this->counts->col_start(j);
+	for (size_t k = hits_start; k < this->counts->col_end(j); ++k) {
+	  chunk_hits[this->counts->row_id(k)] += std::exp(hits_col[k - hits_start] - m + rhs[j]);
+	  chunk_missed[this->counts->row_id(k)] += ec_missed;
+	}
+      }
+    }
+  }
+
+  double missed_total = 0.0;
+  double norm_total = 0.0;
+  for (unsigned c = 0; c < n_chunks; ++c) {
+    missed_total += missed[c];
+    norm_total += norms[c];
+  }
+#pragma omp parallel for schedule(static)
+  for (unsigned i = 0; i < n_rows; ++i) {
+    double hits_i = 0.0;
+    double missed_i = missed_total;
+    for (unsigned c = 0; c < n_chunks; ++c) {
+      hits_i += hit_sums[(size_t)c*n_rows + i];
+      missed_i -= hit_missed[(size_t)c*n_rows + i];
+    }
+    result[i] = hits_i + this->group_weight[i]*std::max(missed_i, 0.0);
+  }
+  return norm_total;
+}
+
+double FixedPointPosterior::operator()(const unsigned row, const unsigned col) const {
+  std::vector<double> hits_col(this->get_rows() + 1);
+  double m = this->col_terms(col, hits_col.data());
+  size_t pos = this->counts->find(row, col);
+  if (pos < this->counts->col_end(col)) {
+    return hits_col[pos - this->counts->col_start(col)] - m;
+  }
+  return this->group_term[row] - m;
+}
+
+void FixedPointPosterior::fill_col(const unsigned col, double *result) const {
+  // A column with a missed term has fewer hits than there are groups,
+  // so the terms fit in `result`. The hits are moved to their rows
+  // from the last one since row_id(k) >= k - hits_start.
+  size_t hits_start = this->counts->col_start(col);
+  size_t hits_end = this->counts->col_end(col);
+  double m = this->col_terms(col, result);
+  for (size_t k = hits_end; k > hits_start; --k) {
+    result[this->counts->row_id(k - 1)] = result[k - 1 - hits_start] - m;
+  }
+  size_t k = hits_start;
+  for (unsigned i = 0; i < this->get_rows(); ++i) {
+    if (k < hits_end && this->counts->row_id(k) == i) {
+      ++k;
+    } else {
+      result[i] = this->group_term[i] - m;
+    }
+  }
+}
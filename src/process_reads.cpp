@@ -1,42 +1,227 @@
 #include "process_reads.hpp"
 
-#include "rcg.hpp"
-#include "bxzstr.hpp"
-
-void ProcessReads(const Reference &reference, std::string outfile, Sample &sample, OptimizerArgs args) {
-  // Process pseudoalignments from kallisto.
-  std::cerr << "Building log-likelihood array" << std::endl;
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <exception>
+#include <utility>
 
-  sample.CalcLikelihood(reference.grouping);
+#include "rcg.hpp"
+#include "read_bitfield.hpp"
+#include "block_queue.hpp"
+#include "parallel_output.hpp"
+#include "openmp_config.hpp"
 
-  std::cerr << "Estimating relative abundances" << std::endl;
-  sample.ec_probs = rcg_optl_mat(sample.ll_mat, sample, args.alphas, args.tolerance, args.max_iters);
+void ReportMemoryUse(const RcgWorkspace &workspace, const uint16_t n_groups, const uint32_t n_ecs, const size_t n_hits, const OptimizerArgs &args) {
+  // Peak memory use of the estimation: the optimizer workspace and
+  // the read-reference probabilities, which share the nonzero
+  // structure of the counts.
+  size_t value_size = (args.single_precision ? sizeof(float) : sizeof(double));
+  double posterior_bytes = (double)n_hits*value_size + (double)n_ecs*sizeof(double) + (double)n_groups*sizeof(double);
+  if (args.method == "low-memory") {
+    posterior_bytes = 3.0*n_groups*sizeof(double);
+  }
+  double megabytes = (workspace.size_in_bytes() + posterior_bytes)/1000000.0;
+  std::cerr << "  estimation uses " << megabytes << " megabytes of memory" << std::endl;
+}
 
-  sample.write_abundances(reference.group_names, outfile);  
+void WriteResults(const Reference &reference, std::string outfile, const Sample &sample, const OptimizerArgs &args) {
+  sample.write_abundances(reference.group_names, args, outfile);
   if (args.write_probs && !outfile.empty()) {
     std::unique_ptr<std::ostream> of;
     if (args.gzip_probs) {
       outfile += "_probs.csv.gz";
-      of = std::unique_ptr<std::ostream>(new bxz::ofstream(outfile));
+      of = OpenParallelGzipOutput(outfile, omp_get_max_threads());
     } else {
       outfile += "_probs.csv";
       of = std::unique_ptr<std::ostream>(new std::ofstream(outfile));
     }
-    sample.write_probabilities(reference.group_names, args.gzip_probs, (args.print_probs ? std::cout : *of));
+    sample.write_probabilities(reference.group_names, args, (args.print_probs ? std::cout : *of));
+    CloseOutput(*of, outfile);
+  }
+}
+
+void ProcessReads(const Reference &reference, std::string outfile, Sample &sample, OptimizerArgs args, RcgWorkspace &workspace, std::ostream &log) {
+  // Process pseudoalignments from kallisto after CalcLikelihood.
+  log << "Estimating relative abundances" << std::endl;
+  rcg_optl_mat(*sample.ll_mat, sample.counts, sample.log_ec_counts, sample.total_counts(), args, nullptr, workspace, sample.ec_probs, log);
+  if (outfile.empty() || args.print_probs) {
+    // Results written to std::cout must not interleave.
+#pragma omp critical(process_reads_output)
+    {
+      WriteResults(reference, outfile, sample, args);
+    }
+  } else {
+    WriteResults(reference, outfile, sample, args);
   }
 }
 
+void ProcessReads(const Reference &reference, std::string outfile, Sample &sample, OptimizerArgs args) {
+  std::cerr << "Building log-likelihood array" << std::endl;
+  sample.CalcLikelihood(reference.grouping, reference.likelihoods());
+
+  RcgWorkspace workspace(reference.grouping.n_groups, sample.num_ecs(), sample.counts.nnz(), args);
+  ReportMemoryUse(workspace, reference.grouping.n_groups, sample.num_ecs(), sample.counts.nnz(), args);
+  ProcessReads(reference, outfile, sample, args, workspace, std::cerr);
+}
+
+RcgWorkspace BatchWorkspace(const Reference &reference, const std::vector<std::unique_ptr<Sample>> &bitfields, const OptimizerArgs &args) {
+  // Size the workspace for the largest sample in the batch.
+  uint32_t max_ecs = 0;
+  size_t max_hits = 0;
+  for (uint32_t i = 0; i < bitfields.size(); ++i) {
+    max_ecs = std::max(max_ecs, bitfields[i]->num_ecs());
+    max_hits = std::max(max_hits, bitfields[i]->counts.nnz());
+  }
+  RcgWorkspace workspace(reference.grouping.n_groups, max_ecs, max_hits, args);
+  ReportMemoryUse(workspace, reference.grouping.n_groups, max_ecs, max_hits, args);
+  return workspace;
+}
+
 void ProcessBatch(const Reference &reference, Arguments &args, std::vector<std::unique_ptr<Sample>> &bitfields) {
+  std::cerr << "Building log-likelihood arrays" << std::endl;
+  // The log-likelihoods depend only on the grouping and are shared by
+  // all samples in the batch.
+  std::shared_ptr<const Matrix<double>> shared_lls = reference.likelihoods();
+#pragma omp parallel for schedule(dynamic)
   for (uint32_t i = 0; i < bitfields.size(); ++i) {
-    std::string batch_outfile = (args.outfile.empty() ? args.outfile : args.outfile + "/" + bitfields[i]->cell_name());
-    ProcessReads(reference, batch_outfile, *bitfields[i], args.optimizer);
+    bitfields[i]->CalcLikelihood(reference.grouping, shared_lls);
+  }
+  const RcgWorkspace &largest = BatchWorkspace(reference, bitfields, args.optimizer);
+
+  // Estimate as many samples at a time as there are threads, the
+  // threads that are left over are used inside the optimizer. Each
+  // sample writes its progress only after it has finished.
+  unsigned n_inner;
+  unsigned n_concurrent = concurrent_estimations(bitfields.size(), n_inner);
+  std::cerr << "  estimating " << n_concurrent << " samples at a time with " << n_inner << " thread(s) each" << std::endl;
+  omp_set_max_active_levels(n_inner > 1 ? 2 : 1);
+
+  // Errors can't leave the parallel region; the first one is rethrown
+  // after it.
+  std::exception_ptr error;
+#pragma omp parallel num_threads(n_concurrent)
+  {
+    omp_set_num_threads(n_inner);
+    RcgWorkspace workspace(largest);
+#pragma omp for schedule(dynamic)
+    for (uint32_t i = 0; i < bitfields.size(); ++i) {
+      std::string batch_outfile = (args.outfile.empty() ? args.outfile : args.outfile + "/" + bitfields[i]->cell_name());
+      std::ostringstream log;
+      try {
+	ProcessReads(reference, batch_outfile, *bitfields[i], args.optimizer, workspace, log);
+      } catch (...) {
+#pragma omp critical(batch_error)
+	{
+	  if (!error) {
+	    error = std::current_exception();
+	  }
+	}
+      }
+#pragma omp critical(batch_log)
+      {
+	std::cerr << log.str();
+      }
+      // The posterior is not needed after the results are written.
+      bitfields[i]->ec_probs.reset();
+    }
+  }
+  omp_set_max_active_levels(1);
+  if (error) {
+    std::rethrow_exception(error);
   }
 }
 
 void ProcessBootstrap(Reference &reference, Arguments &args, std::vector<std::unique_ptr<Sample>> &bitfields) {
+  // Init the bootstrap variables
+  std::shared_ptr<const Matrix<double>> shared_lls = reference.likelihoods();
   for (uint32_t i = 0; i < bitfields.size(); ++i) {
     BootstrapSample* bs = static_cast<BootstrapSample*>(&(*bitfields[i]));
-    bs->BootstrapAbundances(reference, args);
-    bs->WriteBootstrap(reference.group_names, args.outfile, args.iters, args.batch_mode);    
+    bs->CalcLikelihood(reference.grouping, shared_lls);
+    bs->InitBootstrap();
+  }
+  RcgWorkspace workspace = BatchWorkspace(reference, bitfields, args.optimizer);
+  for (uint32_t i = 0; i < bitfields.size(); ++i) {
+    BootstrapSample* bs = static_cast<BootstrapSample*>(&(*bitfields[i]));
+    bs->BootstrapAbundances(reference, args, workspace);
+    bs->WriteBootstrap(reference.group_names, args.outfile, args.iters, args.batch_mode, args.optimizer.precision);    
+  }
+}
+
+// Number of samples that may wait between two stages of the manifest
+// pipeline.
+static const size_t MANIFEST_QUEUE_SIZE = 1;
+
+void ProcessManifest(const Reference &reference, const Arguments &args, const std::vector<ManifestEntry> &manifest) {
+  // The samples are read, estimated and written in a pipeline: the
+  // next sample is read and the previous one written while a sample is
+  // estimated. The estimation uses all threads, the reading and the
+  // writing run beside it on a thread each.
+  std::cerr << "Building log-likelihood array" << std::endl;
+  std::shared_ptr<const Matrix<double>> shared_lls = reference.likelihoods();
+  typedef std::pair<uint32_t, std::unique_ptr<Sample>> ManifestSample;
+  BoundedQueue<ManifestSample> to_estimate(MANIFEST_QUEUE_SIZE);
+  BoundedQueue<ManifestSample> to_write(MANIFEST_QUEUE_SIZE);
+  std::exception_ptr read_error;
+  std::exception_ptr estimate_error;
+  std::exception_ptr write_error;
+
+  std::thread reader([&]() {
+    omp_set_num_threads(1);
+    try {
+      for (uint32_t i = 0; i < manifest.size(); ++i) {
+	std::vector<std::unique_ptr<Sample>> read;
+	ReadManifestSample(manifest[i], args.themisto_merge_mode, args.themisto_stream, reference, 1, read);
+	read[0]->CalcLikelihood(reference.grouping, shared_lls);
+	if (!to_estimate.push(ManifestSample(i, std::move(read[0])))) {
+	  break;
+	}
+      }
+    } catch (...) {
+      read_error = std::current_exception();
+    }
+    to_estimate.finish();
+  });
+
+  std::thread writer([&]() {
+    omp_set_num_threads(1);
+    ManifestSample sample;
+    try {
+      while (to_write.pop(sample)) {
+	std::string outfile = (args.outfile.empty() ? manifest[sample.first].name : args.outfile + '/' + manifest[sample.first].name);
+	WriteResults(reference, outfile, *sample.second, args.optimizer);
+	// Free the sample before waiting for the next one.
+	sample.second.reset();
+      }
+    } catch (...) {
+      write_error = std::current_exception();
+      to_write.cancel();
+    }
+  });
+
+  try {
+    RcgWorkspace workspace;
+    ManifestSample sample;
+    while (to_estimate.pop(sample)) {
+      const Sample &bitfield = *sample.second;
+      std::cerr << "Estimating relative abundances for " << manifest[sample.first].name << " (" << sample.first + 1 << '/' << manifest.size() << ")" << std::endl;
+      rcg_optl_mat(*bitfield.ll_mat, bitfield.counts, bitfield.log_ec_counts, bitfield.total_counts(), args.optimizer, nullptr, workspace, sample.second->ec_probs, std::cerr);
+      if (!to_write.push(std::move(sample))) {
+	break;
+      }
+    }
+  } catch (...) {
+    estimate_error = std::current_exception();
+  }
+  // Stop the reader if the estimation ended early.
+  to_estimate.cancel();
+  to_write.finish();
+  reader.join();
+  writer.join();
+
+  for (const std::exception_ptr &error : { read_error, estimate_error, write_error }) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
   }
 }
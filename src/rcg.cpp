@@ -1,189 +1,814 @@
 // Riemannian conjugate gradient for parameter estimation.
+//
+// The likelihood of a group that an equivalence class doesn't hit,
+// logl(i, 0), is the same for every equivalence class. If the
+// posterior of the missed groups has the form group_term[i] +
+// ec_term[j] (see SparsePosterior), so do the natural gradient and
+// the step, and the optimizer only needs to visit the hits of each
+// equivalence class. The sums over the groups that an equivalence
+// class misses are taken as sums over all groups minus the sums over
+// its hits.
 #include "rcg.hpp"
 
-#include <assert.h>
-
 #include <cmath>
 #include <algorithm>
 #include <numeric>
-#include <iostream>
+#include <limits>
+#include <string>
 
 #include "openmp_config.hpp"
+#include "vmath.hpp"
+#include "special_functions.hpp"
+
+// The optimizer visits the equivalence classes in fixed slabs of at
+// least this many columns. Sums over the equivalence classes are
+// accumulated separately for each slab and combined in slab order, so
+// the results don't depend on the number of threads.
+static const unsigned RCG_SLAB_COLS = 256;
+// Large samples are split into at most this many slabs.
+static const unsigned RCG_MAX_SLABS = 256;
+// With --active-set, iterations on all groups before the first groups
+// are frozen, and re-checks of the frozen groups before the
+// optimization falls back to all groups.
+static const uint16_t ACTIVE_SET_BURN_IN = 25;
+static const unsigned ACTIVE_SET_MAX_ROUNDS = 5;
 
-double digamma(double x) {
-  double result = 0, xx, xx2, xx4;
-  assert(x > 0);
-  for ( ; x < 7; ++x)
-    result -= 1/x;
-  x -= 1.0/2.0;
-  xx = 1.0/x;
-  xx2 = xx*xx;
-  xx4 = xx2*xx2;
-  result += std::log(x)+(1./24.)*xx2-(7.0/960.0)*xx4+(31.0/8064.0)*xx4*xx2-(127.0/30720.0)*xx4*xx4;
-  return result;
+unsigned slab_cols(const unsigned n_cols) {
+  return std::max(RCG_SLAB_COLS, (n_cols + RCG_MAX_SLABS - 1)/RCG_MAX_SLABS);
 }
 
-void logsumexp(Matrix<double> &gamma_Z) {
-  unsigned n_cols = gamma_Z.get_cols();
-  unsigned short n_rows = gamma_Z.get_rows();
+template <typename T>
+void prepare_steps(const uint16_t n_groups, const uint32_t n_ecs, const size_t n_hits, RcgSteps<T> &steps) {
+  for (RcgStep<T>* s : { &steps.step, &steps.oldstep }) {
+    s->hits.assign(n_hits, 0.0);
+    s->group_term.assign(n_groups, 0.0);
+    s->ec_term.assign(n_ecs, 0.0);
+  }
+}
 
-#pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < n_cols; ++i) {
-    double m = gamma_Z.log_sum_exp_col(i);
-    for (short unsigned j = 0; j < n_rows; ++j) {
-      gamma_Z(j, i) -= m;
-    }
+template <typename T>
+size_t steps_size_in_bytes(const RcgSteps<T> &steps) {
+  size_t bytes = 0;
+  for (const RcgStep<T>* s : { &steps.step, &steps.oldstep }) {
+    bytes += s->hits.capacity()*sizeof(T);
+    bytes += (s->group_term.capacity() + s->ec_term.capacity())*sizeof(double);
+  }
+  return bytes;
+}
+
+RcgWorkspace::RcgWorkspace(const uint16_t n_groups, const uint32_t n_ecs, const size_t n_hits, const OptimizerArgs &args) {
+  this->prepare(n_groups, n_ecs, n_hits, args);
+}
+
+void RcgWorkspace::prepare(const uint16_t n_groups, const uint32_t n_ecs, const size_t n_hits, const OptimizerArgs &args) {
+  this->N_k.resize(n_groups);
+  this->old_N_k.resize(n_groups);
+  this->digamma_N_k.resize(n_groups);
+  this->squarem_N_k.resize(3*(size_t)n_groups);
+  if (args.method == "low-memory") {
+    // The posterior is not stored between the iterations.
+    return;
+  }
+  unsigned n_slabs = (n_ecs + slab_cols(n_ecs) - 1)/slab_cols(n_ecs);
+  this->n_threads = std::max(this->n_threads, (unsigned)omp_get_max_threads());
+  if (args.single_precision) {
+    prepare_steps(n_groups, n_ecs, n_hits, this->steps_sp);
+  } else {
+    prepare_steps(n_groups, n_ecs, n_hits, this->steps);
+  }
+  this->oldm.resize(n_ecs);
+  this->group_vals.resize(3*(size_t)n_groups);
+  this->slab_N_k.resize((size_t)n_slabs*n_groups);
+  this->slab_missed.resize((size_t)n_slabs*n_groups);
+  this->slab_missed_total.resize(n_slabs);
+  this->slab_norms.resize(n_slabs);
+  this->slab_bounds.resize(n_slabs);
+  // One extra element per column, padded to 64 bytes so that the
+  // threads don't share cache lines.
+  this->thread_cols.resize((size_t)this->n_threads*3*((n_groups + 8)/8)*8);
+}
+
+template <> RcgSteps<double>& RcgWorkspace::get_steps<double>() { return this->steps; }
+template <> RcgSteps<float>& RcgWorkspace::get_steps<float>() { return this->steps_sp; }
+
+double* RcgWorkspace::thread_col(const unsigned n_groups, const unsigned which) {
+  size_t col_size = ((n_groups + 8)/8)*8;
+  return &this->thread_cols[(3*omp_get_thread_num() + which)*col_size];
+}
+
+size_t RcgWorkspace::size_in_bytes() const {
+  size_t bytes = steps_size_in_bytes(this->steps) + steps_size_in_bytes(this->steps_sp);
+  bytes += (this->oldm.capacity() + this->N_k.capacity() + this->digamma_N_k.capacity() + this->group_vals.capacity())*sizeof(double);
+  bytes += (this->old_N_k.capacity() + this->squarem_N_k.capacity())*sizeof(double);
+  bytes += (this->slab_N_k.capacity() + this->slab_missed.capacity() + this->slab_missed_total.capacity())*sizeof(double);
+  bytes += (this->slab_norms.capacity() + this->slab_bounds.capacity() + this->thread_cols.capacity())*sizeof(double);
+  bytes += this->posterior_sums.size_in_bytes();
+  return bytes;
+}
+
+// Pointer to the values in `x` as doubles, converted into `buf` if
+// they are stored in single precision.
+inline const double* as_double(const double* x, const unsigned, double*) {
+  return x;
+}
+
+inline const double* as_double(const float* x, const unsigned n, double* buf) {
+  for (unsigned k = 0; k < n; ++k) {
+    buf[k] = x[k];
   }
+  return buf;
 }
 
-void logsumexp(Matrix<double> &gamma_Z, std::vector<double> &m) {
+template <typename T>
+double mixt_negnatgrad(const SparsePosterior<T> &gamma_Z, const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, RcgWorkspace &ws) {
+  // Squared norm of the natural gradient at gamma_Z. The gradient
+  // itself is not stored; update_gamma recomputes it from the same
+  // inputs while it has the column in cache anyway.
+  //
+  // For a missed group the gradient is dL_dphi(i, j) = missed_grad[i]
+  // - gamma_Z.ec_term[j] with missed_grad[i] = logl(i, 0) +
+  // digamma_N_k[i] - gamma_Z.group_term[i].
   unsigned n_cols = gamma_Z.get_cols();
   unsigned short n_rows = gamma_Z.get_rows();
+  unsigned n_slabs = ws.slab_norms.size();
+  unsigned slab_size = slab_cols(n_cols);
+  const std::vector<double> &digamma_N_k = ws.digamma_N_k;
 
-#pragma omp parallel for schedule(static)
-  for (unsigned i = 0; i < n_cols; ++i) {
-    m[i] = gamma_Z.log_sum_exp_col(i);
+  // Interleaved exp(group_term[i]) * { 1, missed_grad[i], missed_grad[i]^2 }
+  double totals[3] = { 0.0, 0.0, 0.0 };
+  for (unsigned short i = 0; i < n_rows; ++i) {
+    double missed_grad = logl(i, 0) + digamma_N_k[i] - gamma_Z.group_term[i];
+    double weight = std::exp(gamma_Z.group_term[i]);
+    ws.group_vals[3*i] = weight;
+    ws.group_vals[3*i + 1] = weight*missed_grad;
+    ws.group_vals[3*i + 2] = weight*missed_grad*missed_grad;
+    for (unsigned n = 0; n < 3; ++n) {
+      totals[n] += ws.group_vals[3*i + n];
+    }
   }
 
-#pragma omp parallel for schedule(static)
-  for (unsigned short i = 0; i < n_rows; ++i) {
-    for (unsigned j = 0; j < n_cols; ++j) {
-      gamma_Z(i, j) -= m[j];
+#pragma omp parallel
+  {
+    double* q_Z = ws.thread_col(n_rows, 0);
+    double* dL_dphi = ws.thread_col(n_rows, 1);
+    double* hits_buf = ws.thread_col(n_rows, 2);
+#pragma omp for schedule(static)
+    for (unsigned s = 0; s < n_slabs; ++s) {
+      double newnorm = 0.0;
+      unsigned slab_end = std::min(n_cols, (s + 1)*slab_size);
+      for (unsigned j = s*slab_size; j < slab_end; ++j) {
+	size_t hits_start = counts.col_start(j);
+	unsigned n_hits = counts.col_end(j) - hits_start;
+	const double* gamma_hits = as_double(gamma_Z.hits.data() + hits_start, n_hits, hits_buf);
+	vmath::exp(gamma_hits, q_Z, n_hits);
+
+	double colsum = 0.0;
+	double sqsum = 0.0;
+	for (unsigned k = 0; k < n_hits; ++k) {
+	  unsigned short i = counts.row_id(hits_start + k);
+	  dL_dphi[k] = logl(i, counts.value(hits_start + k));
+	  dL_dphi[k] += digamma_N_k[i] - gamma_hits[k];
+	  colsum += dL_dphi[k] * q_Z[k];
+	  sqsum += dL_dphi[k] * dL_dphi[k] * q_Z[k];
+	}
+
+	double missed[3];
+	missed_sums<3>(counts, j, ws.group_vals.data(), totals, missed);
+	double ec_term = gamma_Z.ec_term[j];
+	double ec_weight = std::exp(ec_term);
+	colsum += ec_weight*(missed[1] - ec_term*missed[0]);
+	sqsum += ec_weight*(missed[2] - 2.0*ec_term*missed[1] + ec_term*ec_term*missed[0]);
+
+	// dL_dgamma(i, j) would be q_Z(i, j) * (dL_dphi(i, j) - colsum)
+	newnorm += sqsum - colsum*colsum;
+      }
+      ws.slab_norms[s] = newnorm;
     }
   }
+  return std::accumulate(ws.slab_norms.begin(), ws.slab_norms.end(), 0.0);
 }
 
-double mixt_negnatgrad(const Matrix<double> &gamma_Z, const std::vector<double> &N_k, const Matrix<double> &logl, const std::vector<std::vector<short unsigned>> &counts, Matrix<double> &dL_dphi) {
+template <typename T>
+void update_gamma(const bool revert, const double beta, const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, SparsePosterior<T> &gamma_Z, RcgWorkspace &ws) {
+  // Takes the step from gamma_Z along the natural gradient plus
+  // `beta` times the previous step and normalizes the columns. With
+  // `revert` the step is instead taken back to the plain natural
+  // gradient step, using the normalizing constants `m` of the
+  // rejected step. The partial sums for N_k and the bound are
+  // computed from the normalized column during the same visit.
   unsigned n_cols = gamma_Z.get_cols();
   unsigned short n_rows = gamma_Z.get_rows();
+  unsigned n_slabs = ws.slab_bounds.size();
+  unsigned slab_size = slab_cols(n_cols);
+  const std::vector<double> &digamma_N_k = ws.digamma_N_k;
+  const RcgStep<T> &oldstep = ws.get_steps<T>().oldstep;
+  RcgStep<T> &step = ws.get_steps<T>().step;
+  std::vector<double> &m = ws.oldm;
+  bool momentum = beta > 0;
 
-  std::vector<double> colsums(n_cols, 0.0);
-#pragma omp parallel for schedule(static) reduction(vec_double_plus:colsums)
+  // Move the per-group terms and shift them so that the largest is 0;
+  // the shift is added to the per-equivalence class terms.
+  double shift = -std::numeric_limits<double>::infinity();
   for (unsigned short i = 0; i < n_rows; ++i) {
-    double digamma_N_k = digamma(N_k[i]) - 1.0;
-    for (unsigned j = 0; j < n_cols; ++j) {
-      dL_dphi(i, j) = logl(i, counts[i][j]);
-      dL_dphi(i, j) += digamma_N_k - gamma_Z(i, j);
-      colsums[j] += dL_dphi(i, j) * std::exp(gamma_Z(i, j));
+    if (revert) {
+      gamma_Z.group_term[i] -= (momentum ? beta*oldstep.group_term[i] : 0.0);
+    } else {
+      step.group_term[i] = logl(i, 0) + digamma_N_k[i] - gamma_Z.group_term[i];
+      step.group_term[i] += (momentum ? beta*oldstep.group_term[i] : 0.0);
+      gamma_Z.group_term[i] += step.group_term[i];
     }
+    shift = std::max(shift, gamma_Z.group_term[i]);
   }
-  
-  double newnorm = 0.0;
-#pragma omp parallel for schedule(static) reduction(+:newnorm)
+  // Interleaved exp(group_term[i]) * { 1, logl(i, 0) - group_term[i] }
+  double totals[2] = { 0.0, 0.0 };
   for (unsigned short i = 0; i < n_rows; ++i) {
-    for (unsigned j = 0; j < n_cols; ++j) {
-      // dL_dgamma(i, j) would be q_Z(i, j) * (dL_dphi(i, j) - colsums[j])
-      newnorm += std::exp(gamma_Z(i, j)) * (dL_dphi(i, j) - colsums[j]) * dL_dphi(i, j);
+    gamma_Z.group_term[i] -= shift;
+    double weight = std::exp(gamma_Z.group_term[i]);
+    ws.group_vals[2*i] = weight;
+    ws.group_vals[2*i + 1] = weight*(logl(i, 0) - gamma_Z.group_term[i]);
+    totals[0] += ws.group_vals[2*i];
+    totals[1] += ws.group_vals[2*i + 1];
+  }
+
+#pragma omp parallel
+  {
+    double* gamma_col = ws.thread_col(n_rows, 0);
+    double* q_Z = ws.thread_col(n_rows, 1);
+#pragma omp for schedule(static)
+    for (unsigned s = 0; s < n_slabs; ++s) {
+      double* N_k = &ws.slab_N_k[(size_t)s*n_rows];
+      double* missed_N_k = &ws.slab_missed[(size_t)s*n_rows];
+      std::fill(N_k, N_k + n_rows, 0.0);
+      std::fill(missed_N_k, missed_N_k + n_rows, 0.0);
+      double missed_total = 0.0;
+      vmath::CompensatedSum bound;
+      unsigned slab_end = std::min(n_cols, (s + 1)*slab_size);
+      for (unsigned j = s*slab_size; j < slab_end; ++j) {
+	size_t hits_start = counts.col_start(j);
+	unsigned n_hits = counts.col_end(j) - hits_start;
+	T* gamma_hits = gamma_Z.hits.data() + hits_start;
+	double ec_term = gamma_Z.ec_term[j];
+	if (revert) {
+	  ec_term += m[j] - (momentum ? beta*oldstep.ec_term[j] : 0.0);
+	} else {
+	  step.ec_term[j] = -ec_term + (momentum ? beta*oldstep.ec_term[j] : 0.0);
+	  ec_term += step.ec_term[j];
+	}
+	ec_term += shift;
+
+	for (unsigned k = 0; k < n_hits; ++k) {
+	  gamma_col[k] = gamma_hits[k];
+	  if (revert) {
+	    gamma_col[k] += m[j];
+	    if (momentum) {
+	      gamma_col[k] -= beta*oldstep.hits[hits_start + k];
+	    }
+	  } else {
+	    unsigned short i = counts.row_id(hits_start + k);
+	    double dL_dphi = logl(i, counts.value(hits_start + k));
+	    dL_dphi += digamma_N_k[i] - gamma_col[k];
+	    if (momentum) {
+	      dL_dphi += beta*oldstep.hits[hits_start + k];
+	    }
+	    step.hits[hits_start + k] = dL_dphi;
+	    gamma_col[k] += dL_dphi;
+	  }
+	}
+
+	// Normalize over the hits and the missed groups.
+	double missed[2];
+	missed_sums<2>(counts, j, ws.group_vals.data(), totals, missed);
+	unsigned n_terms = n_hits;
+	if (missed[0] > 0.0) {
+	  gamma_col[n_terms++] = ec_term + std::log(missed[0]);
+	}
+	m[j] = vmath::log_sum_exp(gamma_col, n_terms);
+	for (unsigned k = 0; k < n_hits; ++k) {
+	  gamma_col[k] -= m[j];
+	  gamma_hits[k] = gamma_col[k];
+	}
+	ec_term -= m[j];
+	gamma_Z.ec_term[j] = ec_term;
+
+	vmath::exp(gamma_col, q_Z, n_hits);
+	double ec_count = std::exp(log_ec_counts[j]);
+	double ec_missed = std::exp(ec_term)*ec_count;
+	double col_bound = 0.0;
+	for (unsigned k = 0; k < n_hits; ++k) {
+	  unsigned short i = counts.row_id(hits_start + k);
+	  N_k[i] += q_Z[k]*ec_count;
+	  missed_N_k[i] += ec_missed;
+	  col_bound += q_Z[k]*(logl(i, counts.value(hits_start + k)) - gamma_col[k]);
+	}
+	missed_total += ec_missed;
+	bound.add(col_bound*ec_count + ec_missed*(missed[1] - ec_term*missed[0]));
+      }
+      ws.slab_missed_total[s] = missed_total;
+      ws.slab_bounds[s] = bound.value();
     }
   }
-  return newnorm;
 }
 
-void ELBO_rcg_mat(const Matrix<double> &logl, const Matrix<double> &gamma_Z, const std::vector<double> &counts, const std::vector<double> &alpha0, const std::vector<double> &N_k, long double &bound, const Sample &sample) {
-  unsigned short n_rows = gamma_Z.get_rows();
-  unsigned n_cols = gamma_Z.get_cols();
-#pragma omp parallel for schedule(static) reduction(+:bound)
+template <typename T>
+double combine_slabs(const std::vector<double> &alpha0, const double bound_const, const SparsePosterior<T> &gamma_Z, RcgWorkspace &ws) {
+  // Sums the slab partials in slab order and returns the bound. The
+  // missed groups contribute exp(group_term[i]) * sum_j
+  // exp(ec_term[j]) * count[j] to N_k[i], where the sum is taken over
+  // all equivalence classes minus the ones that hit group i.
+  unsigned short n_rows = ws.N_k.size();
+  unsigned n_slabs = ws.slab_bounds.size();
+  const std::vector<double> &slab_N_k = ws.slab_N_k;
+  const std::vector<double> &slab_missed = ws.slab_missed;
+  std::vector<double> &N_k = ws.N_k;
+
+  double missed_total = 0.0;
+  for (unsigned s = 0; s < n_slabs; ++s) {
+    missed_total += ws.slab_missed_total[s];
+  }
+
+#pragma omp parallel for schedule(static)
   for (unsigned short i = 0; i < n_rows; ++i) {
-    for (unsigned j = 0; j < n_cols; ++j) {
-      bound += std::exp(gamma_Z(i, j) + counts[j])*(logl(i, sample.counts[i][j]) - gamma_Z(i, j));
+    double sum = 0.0;
+    double missed = missed_total;
+    for (unsigned s = 0; s < n_slabs; ++s) {
+      sum += slab_N_k[(size_t)s*n_rows + i];
+      missed -= slab_missed[(size_t)s*n_rows + i];
     }
-    bound -= std::lgamma(alpha0[i]) - std::lgamma(N_k[i]);
+    sum += std::exp(gamma_Z.group_term[i])*std::max(missed, 0.0);
+    N_k[i] = sum + alpha0[i];
   }
+
+  vmath::CompensatedSum bound;
+  bound.add(bound_const);
+  for (unsigned s = 0; s < n_slabs; ++s) {
+    bound.add(ws.slab_bounds[s]);
+  }
+  for (unsigned short i = 0; i < n_rows; ++i) {
+    bound.add(std::lgamma(N_k[i]) - std::lgamma(alpha0[i]));
+  }
+  return bound.value();
 }
 
-void revert_step(Matrix<double> &gamma_Z, const Matrix<double> &step, const std::vector<double> &oldm) {
-  short unsigned n_rows = gamma_Z.get_rows();
-  unsigned n_cols = gamma_Z.get_cols();
-#pragma omp parallel for schedule(static)
-  for (short unsigned i = 0; i < n_rows; ++i) {
-    for (unsigned j = 0; j < n_cols; ++j) {
-      gamma_Z(i, j) += oldm[j];
+double bound_constant(const std::vector<double> &alpha0, const uint32_t total_counts) {
+  unsigned short n_rows = alpha0.size();
+  double bound_const = total_counts;
+#pragma omp parallel for schedule(static) reduction(+:bound_const)
+  for (unsigned short i = 0; i < n_rows; ++i) {
+    bound_const += alpha0[i];
+    bound_const += std::lgamma(alpha0[i]);
+  }
+  return -std::lgamma(bound_const);
+}
+
+template <typename T>
+double init_gamma(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const uint32_t total_counts, const std::vector<double> &alpha0, const double bound_const, const SparsePosterior<T> *initial, RcgWorkspace &ws, SparsePosterior<T> &gamma_Z, unsigned &n_passes) {
+  // Sets the starting point and N_k, returns the bound at the
+  // starting point.
+  unsigned short n_rows = logl.get_rows();
+  double bound = -100000.0;
+  if (initial != nullptr) {
+    // Warm start: N_k and the bound are evaluated at the initial
+    // point (a zero step), so the first step is accepted only if it
+    // improves on the initial point and the optimizer can stop after
+    // the first iteration.
+    if (initial != &gamma_Z) {
+      gamma_Z = *initial;
+    }
+    std::fill(ws.oldm.begin(), ws.oldm.end(), 0.0);
+    update_gamma(true, 0.0, logl, counts, log_ec_counts, gamma_Z, ws);
+    bound = combine_slabs(alpha0, bound_const, gamma_Z, ws);
+    ++n_passes;
+  } else {
+    gamma_Z.assign(counts, std::log(1.0/(double)n_rows)); // where gamma_Z is init at 1.0
+    // The reads are initially spread evenly over the groups.
+    for (unsigned short i = 0; i < n_rows; ++i) {
+      ws.N_k[i] = total_counts/(double)n_rows + alpha0[i];
     }
   }
+  return bound;
+}
+
+void log_convergence(const char* method, const unsigned iters, const unsigned n_passes, const double bound, const bool converged, const char* limit, std::ostream &log) {
+  // Iterations of the optimizers differ in cost, the passes over the
+  // equivalence classes are comparable.
+  log << "  " << method << (converged ? " converged" : " stopped at ") << (converged ? "" : limit) << " after " << iters << " iterations";
+  log << " (" << n_passes << " passes over the equivalence classes), bound: " << bound << '\n';
 }
 
-Matrix<double> rcg_optl_mat(const Matrix<double> &logl, const Sample &sample, const std::vector<double> &alpha0, const double &tol, uint16_t maxiters) {
+// When the optimizers stop (--convergence and --tol).
+struct ConvergenceRule {
+  std::string criterion;
+  double tol;
+  // What the optimizer reports when it runs out of iterations.
+  const char* limit;
+
+  // Whether an accepted iteration that changed the bound by
+  // `bound_change`, had the squared natural gradient norm `grad_norm`
+  // at its start and changed N_k by `n_k_change` is the last one.
+  bool met(const double bound_change, const double grad_norm, const double n_k_change) const {
+    if (this->criterion == "gradient") {
+      return grad_norm < this->tol;
+    } else if (this->criterion == "abundances") {
+      return n_k_change < this->tol;
+    }
+    return bound_change < this->tol;
+  }
+};
+
+double n_k_change(const std::vector<double> &N_k, const double* old_N_k, const uint32_t total_counts) {
+  // Largest change in the relative abundance of a group.
+  double change = 0.0;
+  for (size_t i = 0; i < N_k.size(); ++i) {
+    change = std::max(change, std::abs(N_k[i] - old_N_k[i]));
+  }
+  return change/std::max(total_counts, 1u);
+}
+
+template <typename T>
+bool rcg_optl(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const uint32_t total_counts, const std::vector<double> &alpha0, const ConvergenceRule &rule, uint16_t maxiters, const SparsePosterior<T> *initial, RcgWorkspace &ws, SparsePosterior<T> &gamma_Z, unsigned &n_iters, std::ostream &log) {
+  // Each iteration makes two passes over the equivalence classes: the
+  // conjugate gradient coefficient needs the norm of the gradient over
+  // all columns before the step can be taken. A rejected step costs
+  // one more pass.
   unsigned short n_rows = logl.get_rows();
-  unsigned n_cols = sample.num_ecs();
-  Matrix<double> gamma_Z(n_rows, n_cols, std::log(1.0/(double)n_rows)); // where gamma_Z is init at 1.0
-  Matrix<double> oldstep(n_rows, n_cols, 0.0);
-  Matrix<double> step(n_rows, n_cols, 0.0);
-  std::vector<double> oldm(n_cols, 0.0);
   double oldnorm = 1.0;
-  long double bound = -100000.0;
   bool didreset = false;
-  double bound_const = sample.total_counts();
-  
-#pragma omp parallel for schedule(static) reduction(+:bound_const)
+  bool converged = false;
+  unsigned n_passes = 0;
+  double bound_const = bound_constant(alpha0, total_counts);
+  double bound = init_gamma(logl, counts, log_ec_counts, total_counts, alpha0, bound_const, initial, ws, gamma_Z, n_passes);
+
+  uint16_t k;
+  for (k = 0; k < maxiters; ++k) {
+    for (unsigned short i = 0; i < n_rows; ++i) {
+      ws.digamma_N_k[i] = digamma(ws.N_k[i]) - 1.0;
+    }
+    double newnorm = mixt_negnatgrad(gamma_Z, logl, counts, ws);
+    double beta_FR = newnorm/oldnorm;
+    oldnorm = newnorm;
+
+    // The previous step is forgotten after a reset.
+    double beta = (didreset ? 0.0 : beta_FR);
+    didreset = false;
+
+    update_gamma(false, beta, logl, counts, log_ec_counts, gamma_Z, ws);
+    double oldbound = bound;
+    std::copy(ws.N_k.begin(), ws.N_k.end(), ws.old_N_k.begin());
+    bound = combine_slabs(alpha0, bound_const, gamma_Z, ws);
+    n_passes += 2;
+
+    if (bound < oldbound) {
+      didreset = true;
+      update_gamma(true, beta, logl, counts, log_ec_counts, gamma_Z, ws);
+      bound = combine_slabs(alpha0, bound_const, gamma_Z, ws);
+      ++n_passes;
+    } else {
+      std::swap(ws.get_steps<T>().oldstep, ws.get_steps<T>().step);
+    }
+    if (k % 5 == 0) {
+      log << "  " <<  "iter: " << k << ", bound: " << bound << ", |g|: " << newnorm << '\n';
+    }
+    if (!didreset && rule.met(bound - oldbound, newnorm, n_k_change(ws.N_k, ws.old_N_k.data(), total_counts))) {
+      converged = true;
+      break;
+    }
+  }
+  n_iters = (converged ? k + 1 : k);
+  log_convergence("rcg", n_iters, n_passes, bound, converged, rule.limit, log);
+  log << std::endl;
+  return converged;
+}
+
+template <typename T>
+double fixed_point_update(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const std::vector<double> &alpha0, const double bound_const, RcgWorkspace &ws, SparsePosterior<T> &gamma_Z) {
+  // The plain natural gradient step sets gamma_Z(i, j) to logl(i, j)
+  // + digamma(N_k[i]) normalized over the groups, so it depends only
+  // on N_k. Sets N_k to the counts under the new gamma_Z and returns
+  // the bound.
+  unsigned short n_rows = logl.get_rows();
   for (unsigned short i = 0; i < n_rows; ++i) {
-    bound_const += alpha0[i];
-    bound_const += std::lgamma(alpha0[i]);
+    ws.digamma_N_k[i] = digamma(ws.N_k[i]) - 1.0;
   }
-  
-  bound_const = -std::lgamma(bound_const);
-  std::vector<double> N_k(alpha0.size());
-  gamma_Z.exp_right_multiply(sample.log_ec_counts, N_k);
-  
-#pragma omp parallel for schedule(static)
+  update_gamma(false, 0.0, logl, counts, log_ec_counts, gamma_Z, ws);
+  return combine_slabs(alpha0, bound_const, gamma_Z, ws);
+}
+
+template <typename Update>
+bool squarem_iterate(const std::vector<double> &alpha0, const uint32_t total_counts, const ConvergenceRule &rule, uint16_t maxiters, const char* method, double bound, const Update &update, RcgWorkspace &ws, unsigned &n_passes, unsigned &n_iters, std::ostream &log) {
+  // SQUAREM (Varadhan & Roland 2008, scheme S3) over the fixed point
+  // map N_k -> N_k of the plain update, which `update` applies to
+  // ws.N_k and returns the bound after. Each iteration takes two
+  // updates from N_0, extrapolates from them and takes a third update
+  // from the extrapolated point. If that ends below the bound of the
+  // second update, the third update is taken from the second point
+  // instead, which never decreases the bound. Only three vectors of
+  // N_k are kept besides the posterior.
+  unsigned short n_rows = alpha0.size();
+  bool converged = false;
+  double max_step = 1.0;
+  double* N_0 = ws.squarem_N_k.data();
+  double* N_1 = N_0 + n_rows;
+  double* N_2 = N_1 + n_rows;
+
+  uint16_t k;
+  for (k = 0; k < maxiters; ++k) {
+    double oldbound = bound;
+    std::copy(ws.N_k.begin(), ws.N_k.end(), N_0);
+    update();
+    std::copy(ws.N_k.begin(), ws.N_k.end(), N_1);
+    double bound_2 = update();
+    std::copy(ws.N_k.begin(), ws.N_k.end(), N_2);
+
+    // The step length is at most -1, which extrapolates to N_2, and at
+    // least -max_step. The limit grows while the limited steps are
+    // accepted.
+    double r_norm = 0.0;
+    double v_norm = 0.0;
+    for (unsigned short i = 0; i < n_rows; ++i) {
+      double r = N_1[i] - N_0[i];
+      double v = N_2[i] - 2.0*N_1[i] + N_0[i];
+      r_norm += r*r;
+      v_norm += v*v;
+    }
+    double alpha = (v_norm > 0.0 ? std::min(-1.0, -std::sqrt(r_norm/v_norm)) : -1.0);
+    alpha = std::max(alpha, -max_step);
+    for (unsigned short i = 0; i < n_rows; ++i) {
+      double r = N_1[i] - N_0[i];
+      double v = N_2[i] - 2.0*N_1[i] + N_0[i];
+      ws.N_k[i] = std::max(alpha0[i], N_0[i] - 2.0*alpha*r + alpha*alpha*v);
+    }
+    bound = update();
+    n_passes += 3;
+
+    if (!(bound >= bound_2)) {
+      std::copy(N_2, N_2 + n_rows, ws.N_k.begin());
+      bound = update();
+      ++n_passes;
+    } else if (alpha == -max_step) {
+      max_step *= 4.0;
+    }
+    if (k % 5 == 0) {
+      log << "  " <<  "iter: " << k << ", bound: " << bound << ", step: " << -alpha << '\n';
+    }
+    // The gradient is not computed, the change in N_k is taken over
+    // the whole iteration.
+    if (rule.met(bound - oldbound, std::numeric_limits<double>::infinity(), n_k_change(ws.N_k, N_0, total_counts))) {
+      converged = true;
+      break;
+    }
+  }
+  n_iters = (converged ? k + 1 : k);
+  log_convergence(method, n_iters, n_passes, bound, converged, rule.limit, log);
+  log << std::endl;
+  return converged;
+}
+
+template <typename T>
+bool squarem_optl(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const uint32_t total_counts, const std::vector<double> &alpha0, const ConvergenceRule &rule, uint16_t maxiters, const SparsePosterior<T> *initial, RcgWorkspace &ws, SparsePosterior<T> &gamma_Z, unsigned &n_iters, std::ostream &log) {
+  unsigned n_passes = 0;
+  double bound_const = bound_constant(alpha0, total_counts);
+  double bound = init_gamma(logl, counts, log_ec_counts, total_counts, alpha0, bound_const, initial, ws, gamma_Z, n_passes);
+  if (initial == nullptr) {
+    // The bound at the uniform starting point is not known.
+    bound = -std::numeric_limits<double>::infinity();
+  }
+  auto update = [&]() { return fixed_point_update(logl, counts, log_ec_counts, alpha0, bound_const, ws, gamma_Z); };
+  return squarem_iterate(alpha0, total_counts, rule, maxiters, "squarem", bound, update, ws, n_passes, n_iters, log);
+}
+
+double fixed_point_update(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const std::vector<double> &alpha0, const double bound_const, RcgWorkspace &ws, FixedPointPosterior &gamma_Z) {
+  // The plain update without storing the posterior: recomputes the
+  // posterior of the equivalence classes from digamma(N_k) while
+  // summing the new N_k. The bound is
+  //   sum_j count[j]*m[j] - sum_i digamma(N_k[i])*(N_k'[i] - alpha0[i])
+  // plus the terms of N_k', where m[j] normalizes column j and N_k' are
+  // the new counts.
+  unsigned short n_rows = logl.get_rows();
   for (unsigned short i = 0; i < n_rows; ++i) {
-    N_k[i] += alpha0[i];
+    ws.digamma_N_k[i] = digamma(ws.N_k[i]);
   }
-  
-  for (uint16_t k = 0; k < maxiters; ++k) {
-    double newnorm = mixt_negnatgrad(gamma_Z, N_k, logl, sample.counts, step);
-    double beta_FR = newnorm/oldnorm;
-    oldnorm = newnorm;
-    
-    if (didreset) {
-      oldstep *= 0.0;
-    } else if (beta_FR > 0) {
-      oldstep *= beta_FR;
-      step += oldstep;
+  gamma_Z.assign(logl, counts, ws.digamma_N_k);
+  vmath::CompensatedSum new_bound;
+  new_bound.add(bound_const);
+  new_bound.add(gamma_Z.expected_counts(log_ec_counts, ws.N_k, ws.posterior_sums));
+  for (unsigned short i = 0; i < n_rows; ++i) {
+    new_bound.add(-ws.digamma_N_k[i]*ws.N_k[i]);
+    ws.N_k[i] += alpha0[i];
+    new_bound.add(std::lgamma(ws.N_k[i]) - std::lgamma(alpha0[i]));
+  }
+  return new_bound.value();
+}
+
+bool low_memory_optl(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const uint32_t total_counts, const std::vector<double> &alpha0, const ConvergenceRule &rule, uint16_t maxiters, const Posterior *initial, RcgWorkspace &ws, FixedPointPosterior &gamma_Z, unsigned &n_iters, std::ostream &log) {
+  // The iteration of squarem_optl without storing the posterior.
+  unsigned short n_rows = logl.get_rows();
+  unsigned n_passes = 0;
+  double bound_const = bound_constant(alpha0, total_counts);
+  double bound = -std::numeric_limits<double>::infinity();
+  auto update = [&]() { return fixed_point_update(logl, counts, log_ec_counts, alpha0, bound_const, ws, gamma_Z); };
+
+  if (initial != nullptr) {
+    // Warm start from the counts under the initial posterior; the
+    // bound is evaluated after one update so that the optimizer can
+    // stop after the first iteration.
+    initial->exp_right_multiply(log_ec_counts, ws.N_k, ws.posterior_sums);
+    for (unsigned short i = 0; i < n_rows; ++i) {
+      ws.N_k[i] += alpha0[i];
     }
-    didreset = false;
+    bound = update();
+    n_passes += 2;
+  } else {
+    for (unsigned short i = 0; i < n_rows; ++i) {
+      ws.N_k[i] = total_counts/(double)n_rows + alpha0[i];
+    }
+  }
+  return squarem_iterate(alpha0, total_counts, rule, maxiters, "low-memory", bound, update, ws, n_passes, n_iters, log);
+}
 
-    gamma_Z += step;
-    logsumexp(gamma_Z, oldm);
-    gamma_Z.exp_right_multiply(sample.log_ec_counts, N_k);
+unsigned concurrent_estimations(const unsigned n_tasks, unsigned &n_inner) {
+  unsigned n_threads = omp_get_max_threads();
+  unsigned n_concurrent = std::max(1u, std::min(n_threads, n_tasks));
+  n_inner = n_threads/n_concurrent;
+  return n_concurrent;
+}
 
-#pragma omp parallel for schedule(static)
+template <typename P>
+P& posterior_as(std::unique_ptr<Posterior> &gamma_Z) {
+  // Reuses the buffers of a previous estimation of the same type.
+  P* posterior = dynamic_cast<P*>(gamma_Z.get());
+  if (posterior == nullptr) {
+    posterior = new P();
+    gamma_Z.reset(posterior);
+  }
+  return *posterior;
+}
+
+bool optimize(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const uint32_t total_counts, const OptimizerArgs &args, const Posterior *initial, RcgWorkspace &ws, std::unique_ptr<Posterior> &gamma_Z, unsigned &n_iters, std::ostream &log, const char* limit = "--max-iters") {
+  // Runs at most args.max_iters iterations and sets `n_iters` to the
+  // number that were run. A starting point stored in the other
+  // precision is ignored.
+  ws.prepare(logl.get_rows(), counts.get_cols(), counts.nnz(), args);
+  bool squarem = (args.method == "squarem");
+  ConvergenceRule rule = { args.convergence, args.tolerance, limit };
+  if (args.method == "low-memory") {
+    return low_memory_optl(logl, counts, log_ec_counts, total_counts, args.alphas, rule, args.max_iters, initial, ws, posterior_as<FixedPointPosterior>(gamma_Z), n_iters, log);
+  } else if (args.single_precision) {
+    auto optl = (squarem ? squarem_optl<float> : rcg_optl<float>);
+    return optl(logl, counts, log_ec_counts, total_counts, args.alphas, rule, args.max_iters, dynamic_cast<const SparsePosterior<float>*>(initial), ws, posterior_as<SparsePosterior<float>>(gamma_Z), n_iters, log);
+  } else {
+    auto optl = (squarem ? squarem_optl<double> : rcg_optl<double>);
+    return optl(logl, counts, log_ec_counts, total_counts, args.alphas, rule, args.max_iters, dynamic_cast<const SparsePosterior<double>*>(initial), ws, posterior_as<SparsePosterior<double>>(gamma_Z), n_iters, log);
+  }
+}
+
+template <typename T>
+double update_from_N_k(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const std::vector<double> &alpha0, const double bound_const, RcgWorkspace &ws, SparsePosterior<T> &gamma_Z) {
+  gamma_Z.assign(counts, 0.0);
+  return fixed_point_update(logl, counts, log_ec_counts, alpha0, bound_const, ws, gamma_Z);
+}
+
+double plain_update(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const uint32_t total_counts, const OptimizerArgs &args, const std::vector<double> &N_k, RcgWorkspace &ws, std::unique_ptr<Posterior> &gamma_Z) {
+  // Sets gamma_Z to the plain update from `N_k` in the representation
+  // that `args` selects and ws.N_k to the counts under it. Returns the
+  // bound after the update.
+  ws.prepare(logl.get_rows(), counts.get_cols(), counts.nnz(), args);
+  std::copy(N_k.begin(), N_k.end(), ws.N_k.begin());
+  double bound_const = bound_constant(args.alphas, total_counts);
+  if (args.method == "low-memory") {
+    return fixed_point_update(logl, counts, log_ec_counts, args.alphas, bound_const, ws, posterior_as<FixedPointPosterior>(gamma_Z));
+  } else if (args.single_precision) {
+    return update_from_N_k(logl, counts, log_ec_counts, args.alphas, bound_const, ws, posterior_as<SparsePosterior<float>>(gamma_Z));
+  } else {
+    return update_from_N_k(logl, counts, log_ec_counts, args.alphas, bound_const, ws, posterior_as<SparsePosterior<double>>(gamma_Z));
+  }
+}
+
+void active_set_optl(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const uint32_t total_counts, const OptimizerArgs &args, const Posterior *initial, RcgWorkspace &ws, std::unique_ptr<Posterior> &gamma_Z, std::ostream &log) {
+  // Most groups of a large reference end up with no reads. After a
+  // burn-in on all groups, the groups with fewer than args.active_set
+  // expected reads are frozen: they are left out of the problem, which
+  // gives them zero posterior probability and N_k = alpha0. The active
+  // groups are optimized to convergence and a plain update on all
+  // groups from the result is the re-check. Frozen groups that gain at
+  // least args.active_set reads in it come back and the active groups
+  // are optimized again; otherwise the update is the final estimate.
+  // The burn-in, the optimizations of the active groups, the plain
+  // updates and the fallback share the args.max_iters iterations; an
+  // optimization of the active groups leaves one for its re-check.
+  unsigned short n_rows = logl.get_rows();
+  const std::vector<double> &alpha0 = args.alphas;
+  unsigned n_iters = 0;
+  unsigned iters_used = 0;
+
+  OptimizerArgs burn_in = args;
+  burn_in.max_iters = std::min(args.max_iters, ACTIVE_SET_BURN_IN);
+  log << "  active set: burn-in on all " << n_rows << " groups" << '\n';
+  bool last = (burn_in.max_iters + 1 >= args.max_iters);
+  bool converged = optimize(logl, counts, log_ec_counts, total_counts, burn_in, initial, ws, gamma_Z, n_iters, log, (last ? "--max-iters" : "the end of the burn-in"));
+  iters_used += n_iters;
+  if (converged || last) {
+    return;
+  }
+
+  std::vector<double> N_k(ws.N_k);
+  std::vector<unsigned short> active;
+  std::vector<unsigned short> active_id(n_rows);
+  std::vector<bool> is_active(n_rows);
+  Matrix<double> active_logl;
+  SparseMatrix<uint16_t> active_counts;
+  OptimizerArgs active_args = args;
+  std::unique_ptr<Posterior> start;
+  std::unique_ptr<Posterior> active_gamma_Z;
+  for (unsigned round = 0; round < ACTIVE_SET_MAX_ROUNDS; ++round) {
+    active.clear();
+    active_args.alphas.clear();
     for (unsigned short i = 0; i < n_rows; ++i) {
-      N_k[i] += alpha0[i];
+      active_id[i] = active.size();
+      is_active[i] = (N_k[i] - alpha0[i] >= args.active_set);
+      if (is_active[i]) {
+	active.emplace_back(i);
+	active_args.alphas.emplace_back(alpha0[i]);
+      }
     }
-    
-    long double oldbound = bound;
-    bound = bound_const;
-    ELBO_rcg_mat(logl, gamma_Z, sample.log_ec_counts, alpha0, N_k, bound, sample);
-    
-    if (bound < oldbound) {
-      didreset = true;
-      revert_step(gamma_Z, step, oldm);
-      if (beta_FR > 0) {
-	gamma_Z -= oldstep;
+    log << "  active set: " << active.size() << "/" << n_rows << " groups" << '\n';
+    if (active.size() == n_rows || active.empty()) {
+      break;
+    }
+
+    // The problem restricted to the active groups. The equivalence
+    // classes that hit only frozen groups are kept since their reads
+    // can still go to the active groups that they miss.
+    unsigned n_cols = counts.get_cols();
+    active_logl.resize(active.size(), logl.get_cols(), 0.0);
+    for (unsigned j = 0; j < logl.get_cols(); ++j) {
+      for (unsigned short a = 0; a < active.size(); ++a) {
+	active_logl(a, j) = logl(active[a], j);
       }
-      logsumexp(gamma_Z);
-      gamma_Z.exp_right_multiply(sample.log_ec_counts, N_k);
-      
-#pragma omp parallel for schedule(static)
-      for (unsigned short i = 0; i < n_rows; ++i) {
-	N_k[i] += alpha0[i];
+    }
+    std::vector<uint32_t> col_sizes(n_cols, 0);
+    for (unsigned j = 0; j < n_cols; ++j) {
+      for (size_t k = counts.col_start(j); k < counts.col_end(j); ++k) {
+	col_sizes[j] += is_active[counts.row_id(k)];
       }
+    }
+    active_counts.allocate(active.size(), col_sizes);
+    for (unsigned j = 0; j < n_cols; ++j) {
+      size_t pos = active_counts.col_start(j);
+      for (size_t k = counts.col_start(j); k < counts.col_end(j); ++k) {
+	unsigned i = counts.row_id(k);
+	if (is_active[i]) {
+	  active_counts.row_id(pos) = active_id[i];
+	  active_counts.value(pos) = counts.value(k);
+	  ++pos;
+	}
+      }
+    }
 
-      bound = bound_const;
-      ELBO_rcg_mat(logl, gamma_Z, sample.log_ec_counts, alpha0, N_k, bound, sample);
-    } else {
-      oldstep = step;
+    // Warm start from the current N_k of the active groups.
+    std::vector<double> active_N_k(active.size());
+    for (unsigned short a = 0; a < active.size(); ++a) {
+      active_N_k[a] = N_k[active[a]];
     }
-    if (k % 5 == 0) {
-      std::cerr << "  " <<  "iter: " << k << ", bound: " << bound << ", |g|: " << newnorm << '\n';
+    plain_update(active_logl, active_counts, log_ec_counts, total_counts, active_args, active_N_k, ws, start);
+    active_args.max_iters = args.max_iters - iters_used - 1;
+    optimize(active_logl, active_counts, log_ec_counts, total_counts, active_args, start.get(), ws, active_gamma_Z, n_iters, log);
+    iters_used += n_iters;
+
+    // The bounds above are of the restricted problem; the one of the
+    // re-check is on all groups.
+    std::copy(alpha0.begin(), alpha0.end(), N_k.begin());
+    for (unsigned short a = 0; a < active.size(); ++a) {
+      N_k[active[a]] = ws.N_k[a];
+    }
+    double bound = plain_update(logl, counts, log_ec_counts, total_counts, args, N_k, ws, gamma_Z);
+    ++iters_used;
+    log << "  active set: update on all " << n_rows << " groups, bound: " << bound << '\n';
+    unsigned n_returned = 0;
+    for (unsigned short i = 0; i < n_rows; ++i) {
+      n_returned += (!is_active[i] && ws.N_k[i] - alpha0[i] >= args.active_set);
     }
-    if (bound - oldbound < tol && !didreset) {
-      logsumexp(gamma_Z);
-      std::cerr << std::endl;
-      return(gamma_Z);
+    std::copy(ws.N_k.begin(), ws.N_k.end(), N_k.begin());
+    if (n_returned == 0) {
+      return;
     }
+    log << "  " << n_returned << " frozen groups came back" << '\n';
+    if (iters_used + 1 >= args.max_iters) {
+      log << "  active set: stopped at --max-iters after " << iters_used << " iterations" << '\n';
+      return;
+    }
+  }
+
+  // The active set did not settle: finish on all groups.
+  OptimizerArgs rest = args;
+  rest.max_iters = args.max_iters - iters_used;
+  optimize(logl, counts, log_ec_counts, total_counts, rest, gamma_Z.get(), ws, gamma_Z, n_iters, log);
+}
+
+void rcg_optl_mat(const Matrix<double> &logl, const SparseMatrix<uint16_t> &counts, const std::vector<double> &log_ec_counts, const uint32_t total_counts, const OptimizerArgs &args, const Posterior *initial, RcgWorkspace &ws, std::unique_ptr<Posterior> &gamma_Z, std::ostream &log) {
+  if (args.active_set > 0.0) {
+    active_set_optl(logl, counts, log_ec_counts, total_counts, args, initial, ws, gamma_Z, log);
+  } else {
+    unsigned n_iters;
+    optimize(logl, counts, log_ec_counts, total_counts, args, initial, ws, gamma_Z, n_iters, log);
   }
-  logsumexp(gamma_Z);
-  std::cerr << std::endl;
-  return(gamma_Z);
 }
@@ -1,12 +1,20 @@
 #include "read_bitfield.hpp"
 
+#include <dirent.h>
+
 #include <sstream>
 #include <unordered_map>
 #include <exception>
+#include <algorithm>
+#include <limits>
+#include <iostream>
+#include <iterator>
 
 #include "bxzstr.hpp"
 #include "file.hpp"
 
+#include "parallel_input.hpp"
+
 #include "tools/matchfasta.hpp"
 
 void VerifyGrouping(const unsigned n_refs, std::istream &run_info) {
@@ -85,11 +93,18 @@ void ReadClusterIndicators(std::istream &indicator_file, Reference &reference) {
   reference.grouping.n_groups = str_to_int.size();
 }
 
-void MatchClusterIndicators(const char delim, std::istream &groups, std::istream &fasta, Reference &reference) {
+void MatchClusterIndicators(const char delim, std::istream &groups, const std::string &fasta_path, Reference &reference) {
   std::unordered_map<std::string, unsigned> str_to_int;
   std::vector<std::string> groups_in_fasta;
+  // Uncompressed files are scanned through a memory map.
+  bool mappable = mSWEEP::tools::fasta_is_mappable(fasta_path);
+  std::unique_ptr<File::In> fasta(mappable ? nullptr : new File::In(fasta_path));
   try {
-    mSWEEP::tools::matchfasta(groups, fasta, delim, &groups_in_fasta);
+    if (mappable) {
+      mSWEEP::tools::matchfasta(groups, fasta_path, delim, &groups_in_fasta);
+    } else {
+      mSWEEP::tools::matchfasta(groups, fasta->stream(), delim, &groups_in_fasta);
+    }
   } catch (std::exception &e) {
     throw std::runtime_error("Matching the group indicators to the fasta file failed, is the --groups-list delimiter correct?");
   }
@@ -111,12 +126,109 @@ void MatchClusterIndicators(const char delim, std::istream &groups, std::istream
 }
 
 std::vector<std::string> ReadCellNames(std::istream &cells_file) {
-  Reference reference;
-  ReadClusterIndicators(cells_file, reference);
-  return reference.group_names;
+  // One cell name per line, the line number is the cell id in matrix.tsv.
+  std::vector<std::string> cell_names;
+  std::string name;
+  while (getline(cells_file, name)) {
+    cell_names.emplace_back(name);
+  }
+  return cell_names;
+}
+
+void ReadKallistoBatch(const Grouping &grouping, KallistoFiles &kallisto_files, KallistoBatch *batch) {
+  // Count the references in each group for the equivalence classes in
+  // matrix.ec ("ec_id<tab>ref,ref,...").
+  std::vector<uint32_t> n_hits;
+  std::vector<std::pair<uint32_t, uint16_t>> hits;
+  std::vector<uint32_t> ec_groups;
+  std::string line;
+  while (std::getline(*kallisto_files.ec, line)) {
+    std::stringstream partition(line);
+    std::string part;
+    getline(partition, part, '\t');
+    batch->ec_ids.emplace_back(std::stoul(part));
+    ec_groups.clear();
+    while (getline(partition, part, ',')) {
+      uint32_t ref_id = std::stoul(part);
+      if (ref_id >= grouping.indicators.size()) {
+	throw std::runtime_error("pseudoalignment has more reference sequences than the grouping.");
+      }
+      ec_groups.emplace_back(grouping.indicators[ref_id]);
+    }
+    std::sort(ec_groups.begin(), ec_groups.end());
+    n_hits.emplace_back(0);
+    for (size_t k = 0; k < ec_groups.size(); ++k) {
+      if (k == 0 || ec_groups[k] != ec_groups[k - 1]) {
+	hits.emplace_back(ec_groups[k], 0);
+	++n_hits.back();
+      }
+      ++hits.back().second;
+    }
+  }
+  batch->counts.allocate(grouping.n_groups, n_hits);
+  for (size_t k = 0; k < hits.size(); ++k) {
+    batch->counts.row_id(k) = hits[k].first;
+    batch->counts.value(k) = hits[k].second;
+  }
+
+  uint32_t max_ec_id = 0;
+  for (uint32_t i = 0; i < batch->ec_ids.size(); ++i) {
+    max_ec_id = std::max(max_ec_id, batch->ec_ids[i]);
+  }
+  std::vector<uint32_t> ec_index(max_ec_id + 1, std::numeric_limits<uint32_t>::max());
+  for (uint32_t i = 0; i < batch->ec_ids.size(); ++i) {
+    ec_index[batch->ec_ids[i]] = i;
+  }
+
+  // Split the counts in matrix.tsv ("ec_id<tab>cell<tab>count") by cell.
+  batch->cell_names = ReadCellNames(*kallisto_files.cells);
+  batch->cell_counts.resize(batch->cell_names.size());
+  while (std::getline(*kallisto_files.tsv, line)) {
+    std::stringstream partition(line);
+    uint32_t ec_id, cell, count;
+    if (!(partition >> ec_id >> cell >> count)) {
+      continue;
+    }
+    if (ec_id > max_ec_id || ec_index[ec_id] == std::numeric_limits<uint32_t>::max()) {
+      throw std::runtime_error("matrix.tsv has an equivalence class that is not in matrix.ec.");
+    }
+    if (cell >= batch->cell_names.size()) {
+      throw std::runtime_error("matrix.tsv has more cells than matrix.cells.");
+    }
+    if (count > 0) {
+      batch->cell_counts[cell].emplace_back(ec_index[ec_id], count);
+    }
+  }
+#pragma omp parallel for schedule(dynamic)
+  for (uint32_t i = 0; i < batch->cell_counts.size(); ++i) {
+    std::sort(batch->cell_counts[i].begin(), batch->cell_counts[i].end());
+  }
 }
 
 void ReadBitfield(KallistoFiles &kallisto_files, unsigned n_refs, std::vector<std::unique_ptr<Sample>> &batch, Reference &reference, bool bootstrap_mode) {
+  if (kallisto_files.batch_mode) {
+    // One sample for each cell with alignments, all sharing the
+    // equivalence classes of the batch.
+    KallistoBatch kallisto_batch;
+    ReadKallistoBatch(reference.grouping, kallisto_files, &kallisto_batch);
+    std::vector<uint32_t> cells;
+    for (uint32_t i = 0; i < kallisto_batch.cell_names.size(); ++i) {
+      if (!kallisto_batch.cell_counts[i].empty()) {
+	cells.emplace_back(i);
+	if (bootstrap_mode) {
+	  batch.emplace_back(new BootstrapSample());
+	} else {
+	  batch.emplace_back(new Sample());
+	}
+      }
+    }
+    size_t first = batch.size() - cells.size();
+#pragma omp parallel for schedule(dynamic)
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+      batch[first + i]->read_kallisto_cell(kallisto_batch, cells[i]);
+    }
+    return;
+  }
   if (bootstrap_mode) {
     batch.emplace_back(new BootstrapSample());
   } else {
@@ -125,12 +237,13 @@ void ReadBitfield(KallistoFiles &kallisto_files, unsigned n_refs, std::vector<st
   batch.back()->read_kallisto(n_refs, *kallisto_files.ec, *kallisto_files.tsv);
 }
 
-void ReadBitfield(const std::string &tinfile1, const std::string &tinfile2, const std::string &themisto_mode, const bool bootstrap_mode, const unsigned n_refs, std::vector<std::unique_ptr<Sample>> &batch) {
-  std::vector<std::istream*> strands(2);
+void ReadBitfield(const std::string &tinfile1, const std::string &tinfile2, const std::string &themisto_mode, const bool bootstrap_mode, const unsigned n_refs, const unsigned n_threads, std::vector<std::unique_ptr<Sample>> &batch) {
+  // Each strand is decompressed on its own background thread.
   File::In check_strand_1(tinfile1);
   File::In check_strand_2(tinfile2);
-  strands.at(0) = new bxz::ifstream(tinfile1);
-  strands.at(1) = new bxz::ifstream(tinfile2);
+  std::unique_ptr<std::istream> strand_1 = OpenParallelInput(tinfile1, n_threads);
+  std::unique_ptr<std::istream> strand_2 = OpenParallelInput(tinfile2, n_threads);
+  std::vector<std::istream*> strands = { strand_1.get(), strand_2.get() };
 
   if (bootstrap_mode) {
     batch.emplace_back(new BootstrapSample());
@@ -140,3 +253,173 @@ void ReadBitfield(const std::string &tinfile1, const std::string &tinfile2, cons
 
   batch.back()->read_themisto(get_mode(themisto_mode), n_refs, strands);
 }
+
+bool ReadThemistoLine(std::istream &strand, std::string &line, std::string &read_id, std::vector<uint32_t> &refs) {
+  // One read per line: "read_id ref ref ...", the refs sorted.
+  if (!std::getline(strand, line)) {
+    return false;
+  }
+  std::stringstream partition(line);
+  partition >> read_id;
+  refs.clear();
+  uint32_t ref_id;
+  while (partition >> ref_id) {
+    refs.emplace_back(ref_id);
+  }
+  std::sort(refs.begin(), refs.end());
+  return true;
+}
+
+void StreamThemisto(const std::string &merge_mode, const Grouping &grouping, std::istream &strand_1, std::istream &strand_2, GroupCountEcs *ecs) {
+  if (merge_mode != "union" && merge_mode != "intersection") {
+    throw std::runtime_error("--themisto-mode must be union or intersection when streaming.");
+  }
+  bool merge_union = (merge_mode == "union");
+  // Equivalence classes are keyed by the bytes of their (group, count)
+  // pairs.
+  std::unordered_map<std::string, uint32_t> ec_index;
+  std::string line_1, line_2, read_id_1, read_id_2, key;
+  std::vector<uint32_t> refs_1, refs_2, refs, groups;
+  while (true) {
+    bool has_1 = ReadThemistoLine(strand_1, line_1, read_id_1, refs_1);
+    bool has_2 = ReadThemistoLine(strand_2, line_2, read_id_2, refs_2);
+    if (has_1 != has_2) {
+      throw std::runtime_error("Themisto pseudoalignment files have a different number of reads.");
+    } else if (!has_1) {
+      break;
+    } else if (read_id_1 != read_id_2) {
+      throw std::runtime_error("Themisto pseudoalignment files are not in the same order (run Themisto with --sort-output).");
+    }
+
+    refs.clear();
+    if (merge_union) {
+      std::set_union(refs_1.begin(), refs_1.end(), refs_2.begin(), refs_2.end(), std::back_inserter(refs));
+    } else {
+      std::set_intersection(refs_1.begin(), refs_1.end(), refs_2.begin(), refs_2.end(), std::back_inserter(refs));
+    }
+    if (refs.empty()) {
+      continue;
+    }
+    groups.clear();
+    for (size_t k = 0; k < refs.size(); ++k) {
+      if (refs[k] >= grouping.indicators.size()) {
+	throw std::runtime_error("pseudoalignment has more reference sequences than the grouping.");
+      }
+      groups.emplace_back(grouping.indicators[refs[k]]);
+    }
+    std::sort(groups.begin(), groups.end());
+
+    key.clear();
+    size_t run_start = 0;
+    for (size_t k = 1; k <= groups.size(); ++k) {
+      if (k == groups.size() || groups[k] != groups[run_start]) {
+	uint16_t count = k - run_start;
+	key.append(reinterpret_cast<const char*>(&groups[run_start]), sizeof(uint32_t));
+	key.append(reinterpret_cast<const char*>(&count), sizeof(uint16_t));
+	run_start = k;
+      }
+    }
+    std::unordered_map<std::string, uint32_t>::iterator it = ec_index.find(key);
+    if (it == ec_index.end()) {
+      ec_index.emplace(key, ecs->ec_counts.size());
+      ecs->ec_counts.emplace_back(1);
+    } else {
+      ++ecs->ec_counts[it->second];
+    }
+  }
+
+  size_t pair_size = sizeof(uint32_t) + sizeof(uint16_t);
+  std::vector<uint32_t> n_hits(ecs->ec_counts.size());
+  for (std::unordered_map<std::string, uint32_t>::const_iterator it = ec_index.begin(); it != ec_index.end(); ++it) {
+    n_hits[it->second] = it->first.size()/pair_size;
+  }
+  ecs->counts.allocate(grouping.n_groups, n_hits);
+  for (std::unordered_map<std::string, uint32_t>::const_iterator it = ec_index.begin(); it != ec_index.end(); ++it) {
+    size_t pos = ecs->counts.col_start(it->second);
+    for (size_t k = 0; k < it->first.size(); k += pair_size) {
+      std::copy_n(it->first.data() + k, sizeof(uint32_t), reinterpret_cast<char*>(&ecs->counts.row_id(pos)));
+      std::copy_n(it->first.data() + k + sizeof(uint32_t), sizeof(uint16_t), reinterpret_cast<char*>(&ecs->counts.value(pos)));
+      ++pos;
+    }
+  }
+}
+
+void StreamBitfield(const std::string &tinfile1, const std::string &tinfile2, const std::string &themisto_mode, const bool bootstrap_mode, const Grouping &grouping, const unsigned n_threads, std::vector<std::unique_ptr<Sample>> &batch) {
+  // The strands are opened only once so that named pipes work, "-"
+  // reads the strand from stdin. Each strand is decompressed on its
+  // own background thread.
+  std::unique_ptr<std::istream> strand_1 = OpenParallelInput(tinfile1, n_threads);
+  std::unique_ptr<std::istream> strand_2 = OpenParallelInput(tinfile2, n_threads);
+  if (!strand_1->good() || !strand_2->good()) {
+    throw std::runtime_error("Cannot read the Themisto pseudoalignments.");
+  }
+
+  if (bootstrap_mode) {
+    batch.emplace_back(new BootstrapSample());
+  } else {
+    batch.emplace_back(new Sample());
+  }
+  batch.back()->stream_themisto(themisto_mode, grouping, *strand_1, *strand_2);
+}
+
+void ReadCachedBitfield(const std::string &cache_file, const bool bootstrap_mode, const Grouping &grouping, std::vector<std::unique_ptr<Sample>> &batch) {
+  if (bootstrap_mode) {
+    batch.emplace_back(new BootstrapSample());
+  } else {
+    batch.emplace_back(new Sample());
+  }
+  batch.back()->read_cache(grouping, cache_file);
+}
+
+void ReadManifest(std::istream &manifest_file, std::vector<ManifestEntry> *manifest) {
+  std::string line;
+  size_t line_nr = 0;
+  while (std::getline(manifest_file, line)) {
+    ++line_nr;
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    ManifestEntry entry;
+    std::stringstream partition(line);
+    std::getline(partition, entry.name, '\t');
+    std::string part;
+    while (std::getline(partition, part, '\t')) {
+      if (!part.empty()) {
+	entry.inputs.emplace_back(part);
+      }
+    }
+    if (entry.name.empty() || entry.inputs.empty() || entry.inputs.size() > 2) {
+      throw std::runtime_error("Line " + std::to_string(line_nr) + " in the manifest is not a name followed by one or two tab-separated inputs.");
+    }
+    if (std::find(entry.inputs.begin(), entry.inputs.end(), "-") != entry.inputs.end()) {
+      throw std::runtime_error("Samples in the manifest can't be read from stdin (line " + std::to_string(line_nr) + ").");
+    }
+    manifest->emplace_back(std::move(entry));
+  }
+  if (manifest->empty()) {
+    throw std::runtime_error("The manifest contains 0 samples.");
+  }
+}
+
+void ReadManifestSample(const ManifestEntry &entry, const std::string &themisto_mode, const bool themisto_stream, const Reference &reference, const unsigned n_threads, std::vector<std::unique_ptr<Sample>> &batch) {
+  if (entry.inputs.size() == 2) {
+    if (themisto_stream) {
+      StreamBitfield(entry.inputs[0], entry.inputs[1], themisto_mode, false, reference.grouping, n_threads, batch);
+    } else {
+      ReadBitfield(entry.inputs[0], entry.inputs[1], themisto_mode, false, reference.n_refs, n_threads, batch);
+    }
+    return;
+  }
+
+  // A single input is either a kallisto output folder or a cache.
+  DIR* dir = opendir(entry.inputs[0].c_str());
+  if (dir) {
+    closedir(dir);
+    KallistoFiles kallisto_files(entry.inputs[0], false, n_threads);
+    VerifyGrouping(reference.n_refs, *kallisto_files.run_info);
+    batch.emplace_back(new Sample());
+    batch.back()->read_kallisto(reference.n_refs, *kallisto_files.ec, *kallisto_files.tsv);
+  } else {
+    ReadCachedBitfield(entry.inputs[0], false, reference.grouping, batch);
+  }
+}
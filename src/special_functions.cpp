@@ -0,0 +1,26 @@
+#include "special_functions.hpp"
+
+#include <assert.h>
+
+#include <cmath>
+
+double digamma(double x) {
+  double result = 0, xx, xx2, xx4;
+  assert(x > 0);
+  for ( ; x < 7; ++x)
+    result -= 1/x;
+  x -= 1.0/2.0;
+  xx = 1.0/x;
+  xx2 = xx*xx;
+  xx4 = xx2*xx2;
+  result += std::log(x)+(1./24.)*xx2-(7.0/960.0)*xx4+(31.0/8064.0)*xx4*xx2-(127.0/30720.0)*xx4*xx4;
+  return result;
+}
+
+std::vector<double> log_factorials(const uint16_t max_n) {
+  std::vector<double> table((size_t)max_n + 1);
+  for (size_t n = 0; n <= max_n; ++n) {
+    table[n] = std::lgamma((double)n + 1.0);
+  }
+  return table;
+}
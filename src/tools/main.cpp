@@ -18,7 +18,11 @@ int main (int argc, char *argv[]) {
 
   std::vector<std::string> groups_in_fasta;
   try {
-    mSWEEP::tools::matchfasta(args.groups, args.fasta, args.delim, &groups_in_fasta);
+    if (mSWEEP::tools::fasta_is_mappable(args.fasta_file)) {
+      mSWEEP::tools::matchfasta(args.groups, args.fasta_file, args.delim, &groups_in_fasta);
+    } else {
+      mSWEEP::tools::matchfasta(args.groups, args.fasta, args.delim, &groups_in_fasta);
+    }
   } catch (std::exception &e) {
     std::cerr << "Matching indicators failed :\n  "
 	      << e.what() << '\n'
@@ -1,38 +1,161 @@
 #include "matchfasta.hpp"
 
-#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
 #include <utility>
 #include <algorithm>
 #include <unordered_map>
 
+#include "openmp_config.hpp"
+
 namespace mSWEEP {
 namespace tools {
 
 void read_groups(std::istream &groups, const char delim, std::unordered_map<std::string, std::string> *seq_to_group) {
   std::string line;
   while(getline(groups, line, '\n')) {
-    std::string seqname;
-    std::string group;
-    std::stringstream parts(line);
-    getline(parts, seqname, delim);
+    size_t seqname_end = std::min(line.find(delim), line.size());
+    std::string seqname = line.substr(0, seqname_end);
     if (seq_to_group->find(seqname) == seq_to_group->end()) {
-      getline(parts, group, delim);
-      seq_to_group->insert(std::make_pair(seqname, group));
+      size_t group_start = std::min(seqname_end + 1, line.size());
+      size_t group_end = std::min(line.find(delim, group_start), line.size());
+      seq_to_group->insert(std::make_pair(seqname, line.substr(group_start, group_end - group_start)));
     }
   }
 }
+
+const std::string& find_group(const std::unordered_map<std::string, std::string> &seq_to_group, const std::string &seqname) {
+  std::unordered_map<std::string, std::string>::const_iterator it = seq_to_group.find(seqname);
+  if (it == seq_to_group.end()) {
+    throw exceptions::tools("Sequence " + seqname + " is not in the groups.");
+  }
+  return it->second;
+}
+
 void read_fasta(std::istream &fasta, const std::unordered_map<std::string, std::string> &seq_to_group, std::vector<std::string> *groups_in_fasta) {
-  std::string line;
-  while(getline(fasta, line, '\n')) {
-    if (line.at(0) == '>') { // todo check if seqence exists in the unordered_map
-      groups_in_fasta->push_back(seq_to_group.at(line.erase(0, 1)));
+  // Read the file in blocks and jump from line to line with memchr;
+  // only the headers are copied out.
+  std::vector<char> block(1 << 20);
+  std::string header;
+  bool in_header = false;
+  bool line_start = true;
+  while (fasta) {
+    fasta.read(block.data(), block.size());
+    const char* pos = block.data();
+    const char* end = pos + fasta.gcount();
+    while (pos < end) {
+      if (line_start) {
+	in_header = (*pos == '>');
+	line_start = false;
+	pos += in_header;
+	continue;
+      }
+      const char* newline = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+      const char* line_end = (newline == nullptr ? end : newline);
+      if (in_header) {
+	header.append(pos, line_end);
+      }
+      if (newline != nullptr) {
+	if (in_header) {
+	  groups_in_fasta->push_back(find_group(seq_to_group, header));
+	  header.clear();
+	  in_header = false;
+	}
+	line_start = true;
+      }
+      pos = (newline == nullptr ? end : newline + 1);
+    }
+  }
+  if (in_header) {
+    groups_in_fasta->push_back(find_group(seq_to_group, header));
+  }
+}
+
+bool fasta_is_mappable(const std::string &fasta_path) {
+  // Regular files that don't start with a gzip, bzip2, xz or zstd magic number.
+  struct stat st;
+  if (stat(fasta_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return false;
+  }
+  std::ifstream fasta(fasta_path, std::ios::binary);
+  unsigned char magic[4] = { 0, 0, 0, 0 };
+  fasta.read(reinterpret_cast<char*>(magic), 4);
+  bool gzip = (magic[0] == 0x1f && magic[1] == 0x8b);
+  bool bzip2 = (magic[0] == 'B' && magic[1] == 'Z' && magic[2] == 'h');
+  bool xz = (magic[0] == 0xfd && magic[1] == '7' && magic[2] == 'z' && magic[3] == 'X');
+  bool zstd = (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd);
+  return !(gzip || bzip2 || xz || zstd);
+}
+
+void read_fasta(const std::string &fasta_path, const std::unordered_map<std::string, std::string> &seq_to_group, std::vector<std::string> *groups_in_fasta) {
+  int fd = open(fasta_path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw exceptions::ifstream(fasta_path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw exceptions::ifstream(fasta_path);
+  }
+  size_t size = st.st_size;
+  void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    throw exceptions::ifstream(fasta_path);
+  }
+  const char* data = static_cast<const char*>(mapped);
+
+  // Each chunk reads the headers of the lines that start inside it.
+  unsigned n_chunks = 4*omp_get_max_threads();
+  std::vector<std::vector<std::string>> chunk_groups(n_chunks);
+  std::vector<std::string> missing(n_chunks);
+#pragma omp parallel for schedule(dynamic)
+  for (unsigned i = 0; i < n_chunks; ++i) {
+    size_t pos = size/n_chunks*i;
+    size_t chunk_end = (i == n_chunks - 1 ? size : size/n_chunks*(i + 1));
+    if (pos > 0 && data[pos - 1] != '\n') {
+      const char* newline = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+      pos = (newline == nullptr ? size : newline - data + 1);
+    }
+    while (pos < chunk_end && missing[i].empty()) {
+      const char* newline = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+      size_t line_end = (newline == nullptr ? size : newline - data);
+      if (data[pos] == '>') {
+	std::string header(data + pos + 1, data + line_end);
+	std::unordered_map<std::string, std::string>::const_iterator it = seq_to_group.find(header);
+	if (it == seq_to_group.end()) {
+	  missing[i] = header;
+	} else {
+	  chunk_groups[i].push_back(it->second);
+	}
+      }
+      pos = line_end + 1;
+    }
+  }
+  munmap(mapped, size);
+
+  for (unsigned i = 0; i < n_chunks; ++i) {
+    if (!missing[i].empty()) {
+      throw exceptions::tools("Sequence " + missing[i] + " is not in the groups.");
     }
+    groups_in_fasta->insert(groups_in_fasta->end(), chunk_groups[i].begin(), chunk_groups[i].end());
   }
 }
+
 void matchfasta(std::istream &groups, std::istream &fasta, const char delim, std::vector<std::string> *groups_in_fasta) {
   std::unordered_map<std::string, std::string> seq_to_group;
   read_groups(groups, delim, &seq_to_group);
   read_fasta(fasta, seq_to_group, groups_in_fasta);
 }
+
+void matchfasta(std::istream &groups, const std::string &fasta_path, const char delim, std::vector<std::string> *groups_in_fasta) {
+  std::unordered_map<std::string, std::string> seq_to_group;
+  read_groups(groups, delim, &seq_to_group);
+  read_fasta(fasta_path, seq_to_group, groups_in_fasta);
+}
 }
 }
@@ -0,0 +1,410 @@
+#include "vmath.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+// With GCC on x86-64 the AVX2 and AVX-512 kernels are always compiled
+// and selected at run time based on the CPU. Other compilers use the
+// instruction set the code is compiled for.
+#if defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER) && defined(__x86_64__)
+#define MSWEEP_VMATH_DISPATCH 1
+#endif
+
+#if defined(MSWEEP_VMATH_DISPATCH) || (defined(__AVX2__) && defined(__FMA__))
+#define MSWEEP_VMATH_AVX2 1
+#endif
+#if defined(MSWEEP_VMATH_DISPATCH) || defined(__AVX512F__)
+#define MSWEEP_VMATH_AVX512 1
+#endif
+
+#if defined(MSWEEP_VMATH_AVX2) || defined(MSWEEP_VMATH_AVX512)
+#include <immintrin.h>
+#endif
+
+namespace vmath {
+namespace {
+// exp(x) = 2^n * exp(r) where n = round(x/ln(2)) and |r| <= ln(2)/2.
+// ln(2) is split in two parts so that n*kLn2Hi is exact.
+const double kLog2e = 1.4426950408889634;
+const double kLn2Hi = 6.93147180369123816490e-01;
+const double kLn2Lo = 1.90821492927058770002e-10;
+// Adding 1.5*2^52 rounds a double to the nearest integer and leaves
+// the integer in the low bits of the mantissa.
+const double kShifter = 6755399441055744.0;
+// Arguments are clamped to [kExpMin, kExpMax] before the range
+// reduction, and anything below kExpZero is flushed to zero.
+const double kExpMin = -746.0;
+const double kExpMax = 710.0;
+const double kExpZero = -708.3964185322641;
+
+// Taylor coefficients 1/k! for exp(r), k = 13 down to 2. The
+// truncation error is below 2^-60 for |r| <= ln(2)/2.
+const double kExpPoly[12] = { 1.6059043836821613e-10, 2.0876756987868100e-09,
+			      2.5052108385441720e-08, 2.7557319223985893e-07,
+			      2.7557319223985888e-06, 2.4801587301587302e-05,
+			      1.9841269841269841e-04, 1.3888888888888889e-03,
+			      8.3333333333333333e-03, 4.1666666666666667e-02,
+			      1.6666666666666667e-01, 5.0000000000000000e-01 };
+
+// log(m) = 2*atanh(s) with s = (m - 1)/(m + 1) and m in
+// [sqrt(2)/2, sqrt(2)). The series 2*(s + s^3/3 + s^5/5 + ...) is
+// evaluated as s*P(s^2) with P truncated after s^20.
+const double kLogPoly[11] = { 2.0/21.0, 2.0/19.0, 2.0/17.0, 2.0/15.0,
+			      2.0/13.0, 2.0/11.0, 2.0/9.0, 2.0/7.0,
+			      2.0/5.0, 2.0/3.0, 2.0 };
+const double kSqrt2 = 1.4142135623730951;
+const double kMinNormal = std::numeric_limits<double>::min();
+const double kInf = std::numeric_limits<double>::infinity();
+const double kNaN = std::numeric_limits<double>::quiet_NaN();
+
+struct Kernels {
+  void (*exp)(const double*, double*, const size_t);
+  void (*exp_add)(const double*, const double, double*, const size_t);
+  void (*log)(const double*, double*, const size_t);
+  double (*log_sum_exp)(const double*, const size_t);
+};
+
+namespace generic {
+// Scalar fallback using the system libm.
+void exp(const double *x, double *y, const size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    y[i] = std::exp(x[i]);
+  }
+}
+void exp_add(const double *x, const double c, double *y, const size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    y[i] += std::exp(x[i] + c);
+  }
+}
+void log(const double *x, double *y, const size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    y[i] = std::log(x[i]);
+  }
+}
+double log_sum_exp(const double *x, const size_t n) {
+  double max_elem = x[0];
+  for (size_t i = 1; i < n; ++i) {
+    max_elem = (x[i] > max_elem ? x[i] : max_elem);
+  }
+  double sum = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += std::exp(x[i] - max_elem);
+  }
+  return max_elem + std::log(sum);
+}
+const Kernels kernels = { &exp, &exp_add, &log, &log_sum_exp };
+}
+
+#if defined(MSWEEP_VMATH_AVX2)
+#if defined(MSWEEP_VMATH_DISPATCH)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace avx2 {
+typedef __m256d vec_t;
+const size_t kWidth = 4;
+
+inline vec_t vset(const double x) { return _mm256_set1_pd(x); }
+inline vec_t vmadd(const vec_t a, const vec_t b, const vec_t c) { return _mm256_fmadd_pd(a, b, c); }
+
+// Loads and stores the first `n` < kWidth elements, the rest are set to `fill`.
+inline __m256i tail_mask(const size_t n) {
+  return _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), _mm256_set_epi64x(3, 2, 1, 0));
+}
+inline vec_t vload_tail(const double *x, const size_t n, const double fill) {
+  __m256i mask = tail_mask(n);
+  return _mm256_blendv_pd(vset(fill), _mm256_maskload_pd(x, mask), _mm256_castsi256_pd(mask));
+}
+inline void vstore_tail(double *y, const vec_t v, const size_t n) {
+  _mm256_maskstore_pd(y, tail_mask(n), v);
+}
+
+inline double vreduce_add(const vec_t a) {
+  __m128d lo = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+inline double vreduce_max(const vec_t a) {
+  __m128d lo = _mm_max_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+  return _mm_cvtsd_f64(_mm_max_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+inline vec_t vpow2(const vec_t k) {
+  // 2^k for integral k in [-1022, 1023]
+  __m256i bits = _mm256_castpd_si256(_mm256_add_pd(k, vset(kShifter)));
+  bits = _mm256_slli_epi64(_mm256_add_epi64(bits, _mm256_set1_epi64x(1023)), 52);
+  return _mm256_castsi256_pd(bits);
+}
+
+inline vec_t vexp(const vec_t x_in) {
+  const vec_t zero = _mm256_cmp_pd(x_in, vset(kExpZero), _CMP_LT_OQ);
+  vec_t x = _mm256_min_pd(_mm256_max_pd(x_in, vset(kExpMin)), vset(kExpMax));
+  vec_t n = _mm256_sub_pd(vmadd(x, vset(kLog2e), vset(kShifter)), vset(kShifter));
+  vec_t r = _mm256_fnmadd_pd(n, vset(kLn2Hi), x);
+  r = _mm256_fnmadd_pd(n, vset(kLn2Lo), r);
+  vec_t p = vset(kExpPoly[0]);
+  for (unsigned k = 1; k < 12; ++k) {
+    p = vmadd(p, r, vset(kExpPoly[k]));
+  }
+  p = vmadd(p, r, vset(1.0));
+  p = vmadd(p, r, vset(1.0));
+  // Scale in two steps so that both exponents stay in range.
+  vec_t n1 = _mm256_floor_pd(_mm256_mul_pd(n, vset(0.5)));
+  vec_t n2 = _mm256_sub_pd(n, n1);
+  vec_t ret = _mm256_mul_pd(_mm256_mul_pd(p, vpow2(n1)), vpow2(n2));
+  ret = _mm256_andnot_pd(zero, ret);
+  // The clamping above turns NaN into a finite value, put it back.
+  return _mm256_blendv_pd(ret, x_in, _mm256_cmp_pd(x_in, x_in, _CMP_UNORD_Q));
+}
+
+inline vec_t vlog(const vec_t x) {
+  __m256i bits = _mm256_castpd_si256(x);
+  // Exponent converted to double with the 2^52 trick
+  __m256i e_bits = _mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_castpd_si256(vset(4503599627370496.0)));
+  vec_t e = _mm256_sub_pd(_mm256_castsi256_pd(e_bits), vset(4503599627370496.0 + 1023.0));
+  vec_t m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000fffffffffffffLL)),
+						_mm256_set1_epi64x(0x3ff0000000000000LL)));
+  const vec_t big = _mm256_cmp_pd(m, vset(kSqrt2), _CMP_GT_OQ);
+  m = _mm256_blendv_pd(m, _mm256_mul_pd(m, vset(0.5)), big);
+  e = _mm256_add_pd(e, _mm256_and_pd(big, vset(1.0)));
+  vec_t s = _mm256_div_pd(_mm256_sub_pd(m, vset(1.0)), _mm256_add_pd(m, vset(1.0)));
+  vec_t z = _mm256_mul_pd(s, s);
+  vec_t p = vset(kLogPoly[0]);
+  for (unsigned k = 1; k < 11; ++k) {
+    p = vmadd(p, z, vset(kLogPoly[k]));
+  }
+  vec_t ret = vmadd(e, vset(kLn2Hi), vmadd(e, vset(kLn2Lo), _mm256_mul_pd(s, p)));
+  // Special values: zero and subnormals, negatives, inf and NaN.
+  ret = _mm256_blendv_pd(ret, vset(-kInf), _mm256_cmp_pd(x, vset(kMinNormal), _CMP_LT_OQ));
+  ret = _mm256_blendv_pd(ret, vset(kNaN), _mm256_cmp_pd(x, vset(0.0), _CMP_LT_OQ));
+  ret = _mm256_blendv_pd(ret, x, _mm256_or_pd(_mm256_cmp_pd(x, vset(kInf), _CMP_EQ_OQ), _mm256_cmp_pd(x, x, _CMP_UNORD_Q)));
+  return ret;
+}
+
+void exp(const double *x, double *y, const size_t n) {
+  size_t i = 0;
+  for (; i + kWidth <= n; i += kWidth) {
+    _mm256_storeu_pd(y + i, vexp(_mm256_loadu_pd(x + i)));
+  }
+  if (i < n) {
+    vstore_tail(y + i, vexp(vload_tail(x + i, n - i, 0.0)), n - i);
+  }
+}
+
+void exp_add(const double *x, const double c, double *y, const size_t n) {
+  const vec_t shift = vset(c);
+  size_t i = 0;
+  for (; i + kWidth <= n; i += kWidth) {
+    _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), vexp(_mm256_add_pd(_mm256_loadu_pd(x + i), shift))));
+  }
+  if (i < n) {
+    vec_t tail = _mm256_add_pd(vload_tail(y + i, n - i, 0.0), vexp(_mm256_add_pd(vload_tail(x + i, n - i, 0.0), shift)));
+    vstore_tail(y + i, tail, n - i);
+  }
+}
+
+void log(const double *x, double *y, const size_t n) {
+  size_t i = 0;
+  for (; i + kWidth <= n; i += kWidth) {
+    _mm256_storeu_pd(y + i, vlog(_mm256_loadu_pd(x + i)));
+  }
+  if (i < n) {
+    vstore_tail(y + i, vlog(vload_tail(x + i, n - i, 1.0)), n - i);
+  }
+}
+
+double log_sum_exp(const double *x, const size_t n) {
+  vec_t vmax = vset(-kInf);
+  size_t i = 0;
+  for (; i + kWidth <= n; i += kWidth) {
+    vmax = _mm256_max_pd(vmax, _mm256_loadu_pd(x + i));
+  }
+  if (i < n) {
+    vmax = _mm256_max_pd(vmax, vload_tail(x + i, n - i, -kInf));
+  }
+  const double max_elem = vreduce_max(vmax);
+  const vec_t shift = vset(-max_elem);
+  vec_t vsum = vset(0.0);
+  for (i = 0; i + kWidth <= n; i += kWidth) {
+    vsum = _mm256_add_pd(vsum, vexp(_mm256_add_pd(_mm256_loadu_pd(x + i), shift)));
+  }
+  if (i < n) {
+    vsum = _mm256_add_pd(vsum, vexp(_mm256_add_pd(vload_tail(x + i, n - i, -kInf), shift)));
+  }
+  double sum = vreduce_add(vsum);
+  double log_sum;
+  log(&sum, &log_sum, 1);
+  return max_elem + log_sum;
+}
+const Kernels kernels = { &exp, &exp_add, &log, &log_sum_exp };
+}
+#if defined(MSWEEP_VMATH_DISPATCH)
+#pragma GCC pop_options
+#endif
+#endif
+
+#if defined(MSWEEP_VMATH_AVX512)
+#if defined(MSWEEP_VMATH_DISPATCH)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+namespace avx512 {
+typedef __m512d vec_t;
+const size_t kWidth = 8;
+
+inline vec_t vset(const double x) { return _mm512_set1_pd(x); }
+inline __mmask8 tail_mask(const size_t n) { return (__mmask8)((1u << n) - 1); }
+
+inline vec_t vexp(const vec_t x_in) {
+  const __mmask8 zero = _mm512_cmp_pd_mask(x_in, vset(kExpZero), _CMP_LT_OQ);
+  vec_t x = _mm512_min_pd(_mm512_max_pd(x_in, vset(kExpMin)), vset(kExpMax));
+  vec_t n = _mm512_sub_pd(_mm512_fmadd_pd(x, vset(kLog2e), vset(kShifter)), vset(kShifter));
+  vec_t r = _mm512_fnmadd_pd(n, vset(kLn2Hi), x);
+  r = _mm512_fnmadd_pd(n, vset(kLn2Lo), r);
+  vec_t p = vset(kExpPoly[0]);
+  for (unsigned k = 1; k < 12; ++k) {
+    p = _mm512_fmadd_pd(p, r, vset(kExpPoly[k]));
+  }
+  p = _mm512_fmadd_pd(p, r, vset(1.0));
+  p = _mm512_fmadd_pd(p, r, vset(1.0));
+  // scalef computes p*2^n and handles the exponent range.
+  vec_t ret = _mm512_maskz_mov_pd(~zero, _mm512_scalef_pd(p, n));
+  // The clamping above turns NaN into a finite value, put it back.
+  return _mm512_mask_mov_pd(ret, _mm512_cmp_pd_mask(x_in, x_in, _CMP_UNORD_Q), x_in);
+}
+
+inline vec_t vlog(const vec_t x) {
+  vec_t e = _mm512_getexp_pd(x);
+  vec_t m = _mm512_getmant_pd(x, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_src);
+  const __mmask8 big = _mm512_cmp_pd_mask(m, vset(kSqrt2), _CMP_GT_OQ);
+  m = _mm512_mask_mul_pd(m, big, m, vset(0.5));
+  e = _mm512_mask_add_pd(e, big, e, vset(1.0));
+  vec_t s = _mm512_div_pd(_mm512_sub_pd(m, vset(1.0)), _mm512_add_pd(m, vset(1.0)));
+  vec_t z = _mm512_mul_pd(s, s);
+  vec_t p = vset(kLogPoly[0]);
+  for (unsigned k = 1; k < 11; ++k) {
+    p = _mm512_fmadd_pd(p, z, vset(kLogPoly[k]));
+  }
+  vec_t ret = _mm512_fmadd_pd(e, vset(kLn2Hi), _mm512_fmadd_pd(e, vset(kLn2Lo), _mm512_mul_pd(s, p)));
+  // Special values: zero and subnormals, negatives, inf and NaN.
+  ret = _mm512_mask_mov_pd(ret, _mm512_cmp_pd_mask(x, vset(kMinNormal), _CMP_LT_OQ), vset(-kInf));
+  ret = _mm512_mask_mov_pd(ret, _mm512_cmp_pd_mask(x, vset(0.0), _CMP_LT_OQ), vset(kNaN));
+  ret = _mm512_mask_mov_pd(ret, _mm512_cmp_pd_mask(x, vset(kInf), _CMP_EQ_OQ) | _mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q), x);
+  return ret;
+}
+
+void exp(const double *x, double *y, const size_t n) {
+  size_t i = 0;
+  for (; i + kWidth <= n; i += kWidth) {
+    _mm512_storeu_pd(y + i, vexp(_mm512_loadu_pd(x + i)));
+  }
+  if (i < n) {
+    const __mmask8 mask = tail_mask(n - i);
+    _mm512_mask_storeu_pd(y + i, mask, vexp(_mm512_maskz_loadu_pd(mask, x + i)));
+  }
+}
+
+void exp_add(const double *x, const double c, double *y, const size_t n) {
+  const vec_t shift = vset(c);
+  size_t i = 0;
+  for (; i + kWidth <= n; i += kWidth) {
+    _mm512_storeu_pd(y + i, _mm512_add_pd(_mm512_loadu_pd(y + i), vexp(_mm512_add_pd(_mm512_loadu_pd(x + i), shift))));
+  }
+  if (i < n) {
+    const __mmask8 mask = tail_mask(n - i);
+    vec_t tail = _mm512_add_pd(_mm512_maskz_loadu_pd(mask, y + i), vexp(_mm512_add_pd(_mm512_maskz_loadu_pd(mask, x + i), shift)));
+    _mm512_mask_storeu_pd(y + i, mask, tail);
+  }
+}
+
+void log(const double *x, double *y, const size_t n) {
+  size_t i = 0;
+  for (; i + kWidth <= n; i += kWidth) {
+    _mm512_storeu_pd(y + i, vlog(_mm512_loadu_pd(x + i)));
+  }
+  if (i < n) {
+    const __mmask8 mask = tail_mask(n - i);
+    _mm512_mask_storeu_pd(y + i, mask, vlog(_mm512_mask_loadu_pd(vset(1.0), mask, x + i)));
+  }
+}
+
+double log_sum_exp(const double *x, const size_t n) {
+  vec_t vmax = vset(-kInf);
+  size_t i = 0;
+  for (; i + kWidth <= n; i += kWidth) {
+    vmax = _mm512_max_pd(vmax, _mm512_loadu_pd(x + i));
+  }
+  if (i < n) {
+    vmax = _mm512_max_pd(vmax, _mm512_mask_loadu_pd(vset(-kInf), tail_mask(n - i), x + i));
+  }
+  const double max_elem = _mm512_reduce_max_pd(vmax);
+  const vec_t shift = vset(-max_elem);
+  vec_t vsum = vset(0.0);
+  for (i = 0; i + kWidth <= n; i += kWidth) {
+    vsum = _mm512_add_pd(vsum, vexp(_mm512_add_pd(_mm512_loadu_pd(x + i), shift)));
+  }
+  if (i < n) {
+    vsum = _mm512_add_pd(vsum, vexp(_mm512_add_pd(_mm512_mask_loadu_pd(vset(-kInf), tail_mask(n - i), x + i), shift)));
+  }
+  double sum = _mm512_reduce_add_pd(vsum);
+  double log_sum;
+  log(&sum, &log_sum, 1);
+  return max_elem + log_sum;
+}
+const Kernels kernels = { &exp, &exp_add, &log, &log_sum_exp };
+}
+#if defined(MSWEEP_VMATH_DISPATCH)
+#pragma GCC pop_options
+#endif
+#endif
+
+const Kernels& select_kernels() {
+#if defined(MSWEEP_VMATH_DISPATCH)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return avx512::kernels;
+  } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return avx2::kernels;
+  }
+  return generic::kernels;
+#elif defined(MSWEEP_VMATH_AVX512)
+  return avx512::kernels;
+#elif defined(MSWEEP_VMATH_AVX2)
+  return avx2::kernels;
+#else
+  return generic::kernels;
+#endif
+}
+
+const Kernels& kernels() {
+  static const Kernels &selected = select_kernels();
+  return selected;
+}
+}
+
+void exp(const double *x, double *y, const size_t n) {
+  kernels().exp(x, y, n);
+}
+
+void exp_add(const double *x, const double c, double *y, const size_t n) {
+  kernels().exp_add(x, c, y, n);
+}
+
+void log(const double *x, double *y, const size_t n) {
+  kernels().log(x, y, n);
+}
+
+double log_sum_exp(const double *x, const size_t n) {
+  return kernels().log_sum_exp(x, n);
+}
+
+void CompensatedSum::add(const double x) {
+  double t = this->sum + x;
+  if (std::abs(this->sum) >= std::abs(x)) {
+    this->compensation += (this->sum - t) + x;
+  } else {
+    this->compensation += (x - t) + this->sum;
+  }
+  this->sum = t;
+}
+}